@@ -0,0 +1,240 @@
+// Drives the server from the same board over its own IP address and prints
+// what the soak and latency requests asked to have measured:
+//
+//  1. PASV_CYCLES cycles of PASV + LIST, reporting PASV latency and the free
+//     heap every REPORT_EVERY cycles, so drift in either shows up.
+//  2. A SITE CPFR/CPTO copy of a COPY_SIZE file, sending NOOP throughout and
+//     reporting the worst control-reply delay and the longest loop() call.
+//
+// The copy needs twice COPY_SIZE free on LittleFS; 10 MB needs a partition
+// table with a large enough filesystem.
+
+#if defined(ESP32)
+#include <WiFi.h>
+#else
+#include <ESP8266WiFi.h>
+#endif
+#include <ESPAsyncFTPServer.h>
+
+#define WIFI_SSID "your-ssid"
+#define WIFI_PASSWORD "your-password"
+
+#define FTP_USER "ftp"
+#define FTP_PASSWORD "ftp"
+
+#define PASV_CYCLES 10000
+#define REPORT_EVERY 1000
+#define COPY_SIZE (10UL * 1024 * 1024)
+#define REPLY_TIMEOUT 10000
+
+AsyncFTPServer ftp(21);
+WiFiClient control;
+
+// Waits for a complete reply line while the server's loop() keeps running.
+static int readReply(String &line)
+{
+  uint32_t start = millis();
+  line = "";
+  while (millis() - start < REPLY_TIMEOUT)
+  {
+    ftp.loop();
+    while (control.available())
+    {
+      char c = control.read();
+      if (c != '\n')
+      {
+        line += c;
+        continue;
+      }
+
+      line.trim();
+      // Continuation lines of a multi-line reply are skipped.
+      if (line.length() >= 4 && line[3] == ' ')
+        return line.toInt();
+      line = "";
+    }
+    delay(0);
+  }
+  return 0;
+}
+
+static int command(const String &cmd, String &line)
+{
+  control.print(cmd + "\r\n");
+  return readReply(line);
+}
+
+static bool parsePasv(const String &line, IPAddress &ip, uint16_t &port)
+{
+  int open = line.indexOf('(');
+  unsigned a, b, c, d, p1, p2;
+  if (open < 0 || sscanf(line.c_str() + open + 1, "%u,%u,%u,%u,%u,%u", &a, &b, &c, &d, &p1, &p2) != 6)
+    return false;
+
+  ip = IPAddress(a, b, c, d);
+  port = p1 << 8 | p2;
+  return true;
+}
+
+static bool listCycle(uint32_t &pasvTime)
+{
+  String line;
+  uint32_t start = micros();
+  if (command("PASV", line) != 227)
+    return false;
+  pasvTime = micros() - start;
+
+  IPAddress ip;
+  uint16_t port;
+  WiFiClient data;
+  if (!parsePasv(line, ip, port) || !data.connect(ip, port))
+    return false;
+
+  control.print("LIST " FTP_LITTLEFS_ROOT_PATH "\r\n");
+  if (readReply(line) != 150)
+    return false;
+
+  while (data.connected() || data.available())
+  {
+    ftp.loop();
+    while (data.available())
+      data.read();
+  }
+  data.stop();
+  return readReply(line) == 226;
+}
+
+static void pasvSoak()
+{
+  uint32_t baseHeap = ESP.getFreeHeap();
+  uint32_t worst = 0;
+  uint64_t total = 0;
+  uint32_t failures = 0;
+
+  Serial.printf("PASV soak: %u cycles, free heap %u\n", (unsigned)PASV_CYCLES, (unsigned)baseHeap);
+  for (uint32_t i = 1; i <= PASV_CYCLES; i++)
+  {
+    uint32_t pasvTime = 0;
+    if (!listCycle(pasvTime))
+      failures++;
+    total += pasvTime;
+    if (pasvTime > worst)
+      worst = pasvTime;
+
+    if (i % REPORT_EVERY == 0)
+    {
+      uint32_t heap = ESP.getFreeHeap();
+      Serial.printf("%6u cycles: PASV avg %u us, max %u us, heap %u (drift %d), failures %u\n", (unsigned)i,
+                    (unsigned)(total / i), (unsigned)worst, (unsigned)heap, (int)heap - (int)baseHeap,
+                    (unsigned)failures);
+    }
+  }
+}
+
+static bool createFile(const char *path, size_t size)
+{
+  File file = LittleFS.open(path, "w");
+  if (!file)
+    return false;
+
+  uint8_t buf[512];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = i;
+  for (size_t left = size; left;)
+  {
+    size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+    if (file.write(buf, chunk) != chunk)
+      return false;
+    left -= chunk;
+  }
+  return true;
+}
+
+static void jobLatency()
+{
+  String line;
+  Serial.printf("Copy latency: %lu byte copy\n", (unsigned long)COPY_SIZE);
+  LittleFS.remove("/soak.copy");
+  if (!createFile("/soak.bin", COPY_SIZE))
+  {
+    Serial.println("Could not create the source file.");
+    return;
+  }
+  ftp.invalidatePath(FTP_LITTLEFS_ROOT_PATH "/soak.bin");
+
+  if (command("SITE CPFR " FTP_LITTLEFS_ROOT_PATH "/soak.bin", line) != 350)
+  {
+    Serial.println("CPFR failed: " + line);
+    return;
+  }
+
+  uint32_t start = millis();
+  control.print("SITE CPTO " FTP_LITTLEFS_ROOT_PATH "/soak.copy\r\n");
+
+  uint32_t worstReply = 0;
+  uint32_t worstLoop = 0;
+  uint32_t noops = 0;
+  int code = 0;
+  String result;
+  while (!code && millis() - start < 10UL * 60 * 1000)
+  {
+    // The copy's final reply may arrive instead of, or before, the NOOP's.
+    uint32_t sent = micros();
+    control.print("NOOP\r\n");
+    while (code >= 0)
+    {
+      uint32_t before = micros();
+      ftp.loop();
+      uint32_t spent = micros() - before;
+      if (spent > worstLoop)
+        worstLoop = spent;
+
+      if (!control.available())
+        continue;
+
+      int reply = readReply(line);
+      if (reply == 200)
+        break;
+      code = reply ? reply : -1;
+      result = line;
+    }
+
+    uint32_t waited = micros() - sent;
+    if (waited > worstReply)
+      worstReply = waited;
+    noops++;
+  }
+
+  Serial.printf("Copy finished in %u ms: %s\n", (unsigned)(millis() - start), result.c_str());
+  Serial.printf("%u NOOPs, worst reply %u us, longest loop() %u us\n", (unsigned)noops, (unsigned)worstReply,
+                (unsigned)worstLoop);
+  LittleFS.remove("/soak.bin");
+  LittleFS.remove("/soak.copy");
+}
+
+void setup()
+{
+  Serial.begin(115200);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  while (WiFi.status() != WL_CONNECTED)
+    delay(100);
+
+  ftp.begin(FTP_USER, FTP_PASSWORD);
+
+  String line;
+  if (!control.connect(WiFi.localIP(), 21) || readReply(line) != 220 ||
+      command("USER " FTP_USER, line) != 331 || command("PASS " FTP_PASSWORD, line) != 230)
+  {
+    Serial.println("Login failed: " + line);
+    return;
+  }
+
+  pasvSoak();
+  jobLatency();
+  command("QUIT", line);
+}
+
+void loop()
+{
+  ftp.loop();
+}
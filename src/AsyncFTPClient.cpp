@@ -2,29 +2,51 @@
 
 void AsyncFTPClient::_onData(void *buf, size_t len)
 {
-  _command.write((char *)buf, len);
-  while (_command.hasLine())
+  const uint8_t *data = (const uint8_t *)buf;
+  _replyBatch = true;
+
+  while (len && !_closing)
   {
-    _handleCommand();
+    size_t consumed = _command.write(data, len);
+    data += consumed;
+    len -= consumed;
+
+    if (!_command.hasLine())
+      break;
+
+    if (_command.lineTooLong())
+      reply("500 Command line too long.\r\n");
+    else
+      _handleCommand();
     _command.nextLine();
   }
+
+  // Everything answered in this batch leaves in one segment.
+  _replyBatch = false;
+  flush();
+}
+
+void AsyncFTPClient::_onPoll()
+{
+  if (_closing)
+    _client->close();
 }
 
 void AsyncFTPClient::_sendSyntaxError()
 {
-  write("501 Syntax error in parameters or arguments.");
+  reply("501 Syntax error in parameters or arguments.\r\n");
 }
 
 void AsyncFTPClient::_sendBadSequence()
 {
-  write("503 Bad sequence of commands");
+  reply("503 Bad sequence of commands\r\n");
 }
 
 void AsyncFTPClient::_authenticate()
 {
-  String cmd = _command.getWord();
+  uint32_t verb = _command.getVerb();
 
-  if (cmd.equalsIgnoreCase("USER"))
+  if (verb == ftpVerb("USER"))
   {
     String user = _command.getRest();
 
@@ -36,17 +58,17 @@ void AsyncFTPClient::_authenticate()
 
     if (user == _server->user())
     {
-      write("331 User name okay, need password.");
+      reply("331 User name okay, need password.\r\n");
       return;
     }
 
     if (user == "anonymous")
     {
-      write("332 Need account for login.");
+      reply("332 Need account for login.\r\n");
       return;
     }
   }
-  else if (cmd.equalsIgnoreCase("PASS"))
+  else if (verb == ftpVerb("PASS"))
   {
     String pass = _command.getRest();
 
@@ -59,57 +81,12 @@ void AsyncFTPClient::_authenticate()
     if (pass == _server->password())
     {
       _authenticated = true;
-      write("230 User logged in, proceed.");
+      reply("230 User logged in, proceed.\r\n");
       return;
     }
   }
 
-  write("530 Not logged in.");
-}
-
-static String normalizePath(const String &input)
-{
-  String path = input;
-  path.replace("\\", "/");
-
-  if (!path.startsWith("/"))
-    path = "/" + path;
-
-  String out = "/";
-  int len = path.length();
-  int i = 1;
-
-  while (i < len)
-  {
-    while (i < len && path[i] == '/')
-      i++;
-
-    if (i >= len)
-      break;
-
-    int start = i;
-    while (i < len && path[i] != '/')
-      i++;
-
-    String token = path.substring(start, i);
-
-    if (token != ".")
-    {
-      if (token == "..")
-      {
-        int last = out.lastIndexOf('/', out.length() - 2);
-        if (last >= 0)
-          out = out.substring(0, last + 1);
-      }
-      else
-      {
-        out += token;
-        out += "/";
-      }
-    }
-  }
-
-  return out;
+  reply("530 Not logged in.\r\n");
 }
 
 void AsyncFTPClient::_handleCWD(String path, bool cdup)
@@ -125,55 +102,60 @@ void AsyncFTPClient::_handleCWD(String path, bool cdup)
   else if (!path.startsWith("/"))
     path = _cwd + path;
 
-  path = normalizePath(path);
+  path = AsyncFTPServer::normalizePath(path);
 
   bool success = false;
 
+  FTPFileStat st;
   if (path == FTP_ROOT_PATH)
     success = true;
-  else
-  {
-    File file = _server->resolveFile(path);
-    if (file)
-    {
-      success = file.isDirectory();
-      file.close();
-    }
-  }
+  else if (_server->stat(path, st))
+    success = st.isDirectory;
 
   if (success)
   {
     _cwd = path;
     if (cdup)
-      write("200 Working directory changed.");
+      reply("200 Working directory changed.\r\n");
     else
-      write("250 Working directory changed.");
+      reply("250 Working directory changed.\r\n");
   }
   else
-    write("550 Directory not found.");
+    reply("550 Directory not found.\r\n");
 }
 
 void AsyncFTPClient::_handleQUIT()
 {
-  write("221 Goodbye.");
-  _client->close();
+  reply("221 Goodbye.\r\n");
+  flush();
+
+  // Closing here would free the connection while AsyncTCP is still inside
+  // the receive callback that delivered QUIT.
+  _closing = true;
 }
 
 void AsyncFTPClient::_handlePASV()
 {
   if (_pasiveServer)
-    _pasiveServer->end();
+    _server->releasePassive(_pasiveServer);
+  _pasiveServer = nullptr;
+
+  _reapDataChannels();
+  if (_dataChannelCount >= FTP_DATA_CHANNELS_MAX)
+  {
+    reply("425 Too many open data connections.\r\n");
+    return;
+  }
 
-  uint16_t port = random(FTP_PASV_PORT_MIN, FTP_PASV_PORT_MAX);
-  _pasiveServer = new AsyncFTPPasiveServer(_server, this, port);
+  _pasiveServer = _server->acquirePassive(this);
 
   if (!_pasiveServer)
-    write("425 Can't open data connection.");
+    reply("425 Can't open data connection.\r\n");
 }
 
 void AsyncFTPClient::_handleTYPE()
 {
-  String type = _command.getWord();
+  FTPToken type = _command.word();
 
   if (type.isEmpty())
   {
@@ -191,11 +173,34 @@ void AsyncFTPClient::_handleTYPE()
     _dataType = FTP_TYPE_LOCAL;
   else
   {
-    write("504 Unknown data type " + type);
+    writef("504 Unknown data type %.*s", (int)type.length, type.data);
+    return;
+  }
+
+  writef("200 Type set to %.*s", (int)type.length, type.data);
+}
+
+void AsyncFTPClient::_handleMODE()
+{
+  FTPToken mode = _command.word();
+
+  if (mode.isEmpty())
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  if (mode.equalsIgnoreCase("S"))
+    _mode = FTP_MODE_STREAM;
+  else if (mode.equalsIgnoreCase("Z"))
+    _mode = FTP_MODE_DEFLATE;
+  else
+  {
+    writef("504 Unsupported transfer mode %.*s", (int)mode.length, mode.data);
     return;
   }
 
-  write("200 Type set to " + type);
+  writef("200 Mode set to %.*s", (int)mode.length, mode.data);
 }
 
 void AsyncFTPClient::_handleOPTS()
@@ -207,13 +212,28 @@ void AsyncFTPClient::_handleOPTS()
 
   bool enabled = state == "ON";
 
+  if (type == "HASH")
+  {
+    FTPHashAlgorithm algorithm;
+    if (state.isEmpty())
+      writef("200 %s", AsyncFTPDigest::name(_hashAlgorithm));
+    else if (AsyncFTPDigest::parse(state, algorithm))
+    {
+      _hashAlgorithm = algorithm;
+      writef("200 %s", AsyncFTPDigest::name(algorithm));
+    }
+    else
+      reply("501 Unknown hash algorithm.\r\n");
+    return;
+  }
+
   if (type == "UTF8")
     _utf8 = enabled;
 
-  write("200 " + type + " " + state);
+  writef("200 %s %s", type.c_str(), state.c_str());
 }
 
-void AsyncFTPClient::_handleSTOR()
+void AsyncFTPClient::_handleSTOR(FTPCommand command)
 {
   if (!_pasiveServer)
   {
@@ -222,6 +242,15 @@ void AsyncFTPClient::_handleSTOR()
   }
 
   String path = _command.getRest();
+  size_t offset = _restOffset;
+  _restOffset = 0;
+  _restLength = SIZE_MAX;
+
+  // An expected digest only applies to the upload that follows it.
+  String expected = _expectedDigest;
+  _expectedDigest = "";
+  bool digest = !expected.isEmpty() || _server->uploadDigest();
+  FTPHashAlgorithm algorithm = expected.isEmpty() ? _hashAlgorithm : _expectedAlgorithm;
 
   if (path.isEmpty())
   {
@@ -229,9 +258,27 @@ void AsyncFTPClient::_handleSTOR()
     return;
   }
 
+  // Uploads to a sink bypass the filesystem and cannot be resumed.
+  const FTPVirtualFile *virt = _server->findVirtualFile(_cwd + path);
+  if (virt)
+  {
+    if (!virt->sink)
+      reply("550 Cannot write to read-only file.\r\n");
+    else if (offset)
+      reply("554 Invalid REST parameter.\r\n");
+    else
+    {
+      _pasiveServer->setSink(*virt);
+      if (digest)
+        _pasiveServer->setStoreDigest(algorithm, expected, false);
+      _startTransfer(FTP_COMMAND_STOR, File(), nullptr);
+    }
+    return;
+  }
+
   if (_cwd == FTP_ROOT_PATH)
   {
-    write("550 Cannot write to read-only directory.");
+    reply("550 Cannot write to read-only directory.\r\n");
     return;
   }
 
@@ -239,18 +286,63 @@ void AsyncFTPClient::_handleSTOR()
   String fsPath;
   if (!_server->resolveFsPath(_cwd + path, fs, fsPath))
   {
-    write("451 Local error in processing.");
+    reply("451 Local error in processing.\r\n");
+    return;
+  }
+
+  FTPFileStat st;
+  bool replace = !offset && command != FTP_COMMAND_APPE && _server->stat(_cwd + path, st) && !st.isDirectory;
+
+  // The existing file is only read until the upload first differs from it.
+  if (replace && _skipIdentical)
+  {
+    File file = fs->open(fsPath, FILE_READ);
+    if (file)
+    {
+      _pasiveServer->setSkipIdentical();
+      if (digest)
+        _pasiveServer->setStoreDigest(algorithm, expected, true);
+      _startTransfer(FTP_COMMAND_STOR, file, fs);
+      return;
+    }
+  }
+
+  // Truncating an existing file frees its space before the upload refills it.
+  if (replace)
+    _server->adjustUsedSpace(fs, -(int64_t)st.size);
+
+  AsyncFTPSidecar::invalidate(*fs, fsPath);
+  _server->invalidatePath(_cwd + path);
+
+  // A restarted upload keeps what is already on disk and continues at the
+  // marker, so the file must not be truncated on open.
+  const char *mode = offset ? "r+" : FILE_WRITE;
+  if (command == FTP_COMMAND_APPE)
+  {
+    offset = 0;
+    mode = FILE_APPEND;
+  }
+
+  File file = fs->open(fsPath, mode);
+  if (file && offset && (offset > file.size() || !file.seek(offset)))
+  {
+    file.close();
+    reply("554 Invalid REST parameter.\r\n");
     return;
   }
 
-  File file = fs->open(fsPath, FILE_WRITE);
   if (!file)
   {
-    write("553 Cannot open file for writing.");
-    _pasiveServer->end();
+    reply("553 Cannot open file for writing.\r\n");
+    _server->releasePassive(_pasiveServer);
+    _pasiveServer = nullptr;
   }
   else
-    _pasiveServer->setCommand(FTP_COMMAND_STOR, file, fs);
+  {
+    if (digest)
+      _pasiveServer->setStoreDigest(algorithm, expected, !offset && command != FTP_COMMAND_APPE);
+    _startTransfer(FTP_COMMAND_STOR, file, fs);
+  }
 }
 
 void AsyncFTPClient::_handleSIZE()
@@ -263,32 +355,29 @@ void AsyncFTPClient::_handleSIZE()
     return;
   }
 
-  path = _cwd + path;
-
-  FS *fs;
-  String fsPath;
-  if (!_server->resolveFsPath(path, fs, fsPath))
-  {
-    write("450 File not found.");
-    return;
-  }
-
-  File file = fs->open(fsPath);
-  if (!file)
+  FTPFileStat st;
+  if (!_server->stat(_cwd + path, st))
   {
-    write("450 File not found.");
+    reply("450 File not found.\r\n");
     return;
   }
 
-  size_t size = file.size();
-  file.close();
-
-  write("213 " + String(size));
+  writef("213 %u", (unsigned)st.size);
 }
 
 void AsyncFTPClient::_handleRETR()
 {
+  if (!_pasiveServer)
+  {
+    _sendBadSequence();
+    return;
+  }
+
   String path = _command.getRest();
+  size_t offset = _restOffset;
+  size_t length = _restLength;
+  _restOffset = 0;
+  _restLength = SIZE_MAX;
 
   if (path.isEmpty())
   {
@@ -298,22 +387,138 @@ void AsyncFTPClient::_handleRETR()
 
   path = _cwd + path;
 
+  // Virtual files are produced on demand and never reach a filesystem.
+  const FTPVirtualFile *virt = _server->findVirtualFile(path);
+  if (virt)
+  {
+    if (!virt->producer)
+      reply("550 Cannot read from write-only file.\r\n");
+    else if (virt->sizeHint && offset > virt->sizeHint)
+      reply("554 Invalid REST parameter.\r\n");
+    else
+    {
+      _pasiveServer->setProducer(*virt, offset);
+      _startTransfer(FTP_COMMAND_RETR, File(), nullptr, length);
+    }
+    return;
+  }
+
   FS *fs;
   String fsPath;
   if (!_server->resolveFsPath(path, fs, fsPath))
   {
-    write("451 Local error in processing.");
+    reply("451 Local error in processing.\r\n");
+    return;
+  }
+
+  // Files held by the hot-file tier are served without touching the FS.
+  FTPHotFileRef hot = _server->findHotFile(path);
+  if (hot)
+  {
+    if (offset > hot->size)
+      reply("554 Invalid REST parameter.\r\n");
+    else
+    {
+      _pasiveServer->setHotFile(hot, offset);
+      _startTransfer(FTP_COMMAND_RETR, File(), fs, length);
+    }
     return;
   }
 
   File file = fs->open(fsPath, FILE_READ);
   if (!file)
-    write("450 File not found.");
+    reply("450 File not found.\r\n");
+  else if (offset && (offset > file.size() || !file.seek(offset)))
+  {
+    file.close();
+    reply("554 Invalid REST parameter.\r\n");
+  }
   else
-    _pasiveServer->setCommand(FTP_COMMAND_RETR, file);
+    _startTransfer(FTP_COMMAND_RETR, file, fs, length);
+}
+
+static bool parseOffset(const FTPToken &token, size_t &value)
+{
+  if (token.isEmpty())
+    return false;
+
+  value = 0;
+  for (size_t i = 0; i < token.length; i++)
+  {
+    char c = token.data[i];
+    if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10)
+      return false;
+    value = value * 10 + (c - '0');
+  }
+
+  return true;
+}
+
+void AsyncFTPClient::_handleREST()
+{
+  size_t offset;
+  if (!parseOffset(_command.word(), offset))
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  _restOffset = offset;
+  _restLength = SIZE_MAX;
+  writef("350 Restarting at %u. Send STORE or RETRIEVE to initiate transfer.", (unsigned)offset);
 }
 
-void AsyncFTPClient::_handleLIST()
+void AsyncFTPClient::_handleRANG()
+{
+  size_t start, end;
+  if (!parseOffset(_command.word(), start) || !parseOffset(_command.word(), end))
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  // "RANG 1 0" clears a previously set range.
+  if (start == 1 && end == 0)
+  {
+    _restOffset = 0;
+    _restLength = SIZE_MAX;
+    reply("350 Restarting at 0. Ending at end of file.\r\n");
+    return;
+  }
+
+  if (end < start)
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  _restOffset = start;
+  _restLength = end - start + 1;
+  writef("350 Restarting at %u. Ending at %u.", (unsigned)start, (unsigned)end);
+}
+
+void AsyncFTPClient::_startTransfer(FTPCommand command, File file, FS *fs, size_t length)
+{
+  // The channel keeps running on its own; the next transfer needs a new PASV.
+  _pasiveServer->setCommand(command, file, fs, length);
+  _dataChannels[_dataChannelCount++] = _pasiveServer;
+  _pasiveServer = nullptr;
+}
+
+void AsyncFTPClient::_reapDataChannels()
+{
+  size_t count = 0;
+  for (size_t i = 0; i < _dataChannelCount; i++)
+  {
+    if (_dataChannels[i]->busy())
+      _dataChannels[count++] = _dataChannels[i];
+    else
+      _server->releasePassive(_dataChannels[i]);
+  }
+  _dataChannelCount = count;
+}
+
+void AsyncFTPClient::_handleLIST(FTPCommand command)
 {
   if (!_pasiveServer)
   {
@@ -327,9 +532,47 @@ void AsyncFTPClient::_handleLIST()
     path = _cwd;
 
   File file;
-  if (path != FTP_ROOT_PATH)
-    file = _server->resolveFile(path);
-  _pasiveServer->setCommand(FTP_COMMAND_LIST, file);
+  FS *fs = nullptr;
+  String fsPath;
+  if (path != FTP_ROOT_PATH && _server->resolveFsPath(path, fs, fsPath))
+    file = fs->open(fsPath);
+  _startTransfer(command, file, fs);
+}
+
+void AsyncFTPClient::_handleMLST()
+{
+  String path = _command.getRest();
+
+  if (path.isEmpty())
+    path = _cwd;
+  else if (!path.startsWith("/"))
+    path = _cwd + path;
+
+  char response[FTP_LIST_LINE_MAX + 64];
+  int n = snprintf(response, sizeof(response), "250-Listing %s\r\n ", path.c_str());
+  if (n < 0 || (size_t)n >= sizeof(response) - FTP_LIST_LINE_MAX)
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  if (path == FTP_ROOT_PATH)
+    n += AsyncFTPPasiveClient::formatFacts(response + n, FTP_LIST_LINE_MAX, path.c_str(), true, 0, 0, "el");
+  else
+  {
+    FTPFileStat st;
+    if (!_server->stat(path, st))
+    {
+      reply("550 File not found.\r\n");
+      return;
+    }
+
+    n += AsyncFTPPasiveClient::formatFacts(response + n, FTP_LIST_LINE_MAX, path.c_str(), st.isDirectory,
+                                           st.size, st.lastWrite);
+  }
+
+  snprintf(response + n, sizeof(response) - n, "250 End.");
+  write(response);
 }
 
 void AsyncFTPClient::_handleRNFR()
@@ -346,14 +589,15 @@ void AsyncFTPClient::_handleRNFR()
 
   FS *fs;
   String fsPath;
+  FTPFileStat st;
   if (!_server->resolveFsPath(path, fs, fsPath))
-    write("451 Local error in processing.");
-  else if (!fs->exists(fsPath))
-    write("550 File not found.");
+    reply("451 Local error in processing.\r\n");
+  else if (!_server->stat(path, st))
+    reply("550 File not found.\r\n");
   else
   {
     _renameFromPath = path;
-    write("350 Ready for rename.");
+    reply("350 Ready for rename.\r\n");
   }
 }
 
@@ -377,45 +621,197 @@ void AsyncFTPClient::_handleRNTO()
 
   FS *dstFs;
   String dstPath;
+  FTPFileStat st;
   if (!_server->resolveFsPath(path, dstFs, dstPath))
-    write("451 Local error in processing.");
-  else if (dstFs->exists(dstPath))
-    write("553 Destination file already exists.");
+    reply("451 Local error in processing.\r\n");
+  else if (_server->stat(path, st))
+    reply("553 Destination file already exists.\r\n");
   else
   {
     FS *srcFs;
     String srcPath;
     _server->resolveFsPath(_renameFromPath, srcFs, srcPath);
 
-    bool success = false;
+    if (AsyncFTPSidecar::invalidate(*srcFs, srcPath))
+      _server->adjustUsedSpace(srcFs, 0);
+    if (AsyncFTPSidecar::invalidate(*dstFs, dstPath))
+      _server->adjustUsedSpace(dstFs, 0);
 
+    // Moves between filesystems are copied in the background.
     if (dstFs != srcFs)
     {
-      File srcFile = srcFs->open(srcPath);
-      File dstFile = dstFs->open(dstPath, FILE_WRITE);
-
-      if (srcFile && dstFile)
-      {
-        uint8_t buf[2048];
-        while (srcFile.available())
-        {
-          size_t size = srcFile.read(buf, sizeof(buf));
-          dstFile.write(buf, size);
-        }
-        srcFile.close();
-        dstFile.close();
-        srcFs->remove(srcPath);
-        success = true;
-      }
+      _startCopy(_renameFromPath, path, true);
+      _renameFromPath = "";
+      return;
     }
-    else
-      success = srcFs->rename(srcPath, dstPath);
+
+    bool success = srcFs->rename(srcPath, dstPath);
+
+    _server->invalidatePath(_renameFromPath);
+    _server->invalidatePath(path);
 
     _renameFromPath = "";
     if (success)
-      write("250 File renamed successfully.");
+      reply("250 File renamed successfully.\r\n");
+    else
+      reply("450 Rename failed.\r\n");
+  }
+}
+
+void AsyncFTPClient::_startCopy(const String &from, const String &to, bool move)
+{
+  AsyncFTPCopyJob *job = new AsyncFTPCopyJob(_server, this, move);
+
+  if (!job || !job->begin(from, to))
+  {
+    delete job;
+    if (move)
+      reply("450 Rename failed.\r\n");
+    else
+      reply("450 Copy failed.\r\n");
+  }
+  else if (!_server->startJob(job))
+  {
+    delete job;
+    reply("450 Too many operations in progress.\r\n");
+  }
+}
+
+// Server-side copy, compatible with the CPFR/CPTO pair of ProFTPD's mod_copy,
+// "SITE EXPECT <algorithm> <digest>" to verify the next upload and
+// "SITE SKIPIDENTICAL ON|OFF" to leave unchanged files untouched.
+void AsyncFTPClient::_handleSITE()
+{
+  FTPToken command = _command.word();
+
+  if (command.equalsIgnoreCase("SKIPIDENTICAL"))
+  {
+    String mode = _command.getWord();
+    if (mode.equalsIgnoreCase("ON"))
+      _skipIdentical = true;
+    else if (mode.equalsIgnoreCase("OFF"))
+      _skipIdentical = false;
+    else
+    {
+      _sendSyntaxError();
+      return;
+    }
+
+    writef("200 Skip identical uploads %s.", _skipIdentical ? "on" : "off");
+    return;
+  }
+
+  if (command.equalsIgnoreCase("EXPECT"))
+  {
+    String name = _command.getWord();
+    String digest = _command.getWord();
+    FTPHashAlgorithm algorithm;
+    if (digest.isEmpty() || !AsyncFTPDigest::parse(name, algorithm))
+    {
+      _sendSyntaxError();
+      return;
+    }
+
+    _expectedAlgorithm = algorithm;
+    _expectedDigest = digest;
+    writef("200 Next upload must match %s %s.", AsyncFTPDigest::name(algorithm), digest.c_str());
+    return;
+  }
+
+  String path = _command.getRest();
+
+  if (!command.equalsIgnoreCase("CPFR") && !command.equalsIgnoreCase("CPTO"))
+  {
+    // Anything else is left to a SITE handler the application registered.
+    _command.rewind();
+    if (!_server->dispatchCommand(ftpVerb("SITE"), this))
+      writef("504 Unknown SITE command %.*s", (int)command.length, command.data);
+    return;
+  }
+
+  if (path.isEmpty())
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  if (!path.startsWith("/"))
+    path = _cwd + path;
+
+  FTPFileStat st;
+  if (command.equalsIgnoreCase("CPFR"))
+  {
+    if (!_server->stat(path, st) || st.isDirectory)
+      reply("550 File not found.\r\n");
     else
-      write("450 Rename failed.");
+    {
+      _copyFromPath = path;
+      reply("350 Ready for destination name.\r\n");
+    }
+    return;
+  }
+
+  if (_copyFromPath.isEmpty())
+    _sendBadSequence();
+  else if (_server->stat(path, st))
+    reply("553 Destination file already exists.\r\n");
+  else
+    _startCopy(_copyFromPath, path, false);
+
+  _copyFromPath = "";
+}
+
+void AsyncFTPClient::_handleHASH(FTPHashAlgorithm algorithm, bool extended)
+{
+  String path = _command.getRest();
+  size_t offset = extended ? 0 : _restOffset;
+  size_t length = extended ? SIZE_MAX : _restLength;
+  if (!extended)
+  {
+    _restOffset = 0;
+    _restLength = SIZE_MAX;
+  }
+
+  if (path.isEmpty())
+  {
+    _sendSyntaxError();
+    return;
+  }
+
+  if (!path.startsWith("/"))
+    path = _cwd + path;
+
+  FTPFileStat st;
+  if (!_server->stat(path, st) || st.isDirectory)
+  {
+    reply("550 File not found.\r\n");
+    return;
+  }
+
+  if (offset > st.size)
+  {
+    reply("554 Invalid RANG parameter.\r\n");
+    return;
+  }
+
+  size_t size = length < st.size - offset ? length : st.size - offset;
+  String digest;
+  if (!offset && size == st.size && _server->findDigest(path, algorithm, digest))
+  {
+    write(AsyncFTPHashJob::formatReply(extended, algorithm, offset, size, digest, path));
+    return;
+  }
+
+  AsyncFTPHashJob *job = new AsyncFTPHashJob(_server, this, algorithm, extended);
+  if (!job || !job->begin(path, offset, size))
+  {
+    delete job;
+    reply("451 Local error in processing.\r\n");
+  }
+  else if (!_server->startJob(job))
+  {
+    delete job;
+    reply("450 Too many operations in progress.\r\n");
   }
 }
 
@@ -429,16 +825,24 @@ void AsyncFTPClient::_handleDELE()
     return;
   }
 
+  path = _cwd + path;
+
   FS *fs;
   String fsPath;
-  if (!_server->resolveFsPath(_cwd + path, fs, fsPath))
-    write("451 Local error in processing.");
-  else if (!fs->exists(fsPath))
-    write("550 File not found.");
+  FTPFileStat st;
+  if (!_server->resolveFsPath(path, fs, fsPath))
+    reply("451 Local error in processing.\r\n");
+  else if (!_server->stat(path, st))
+    reply("550 File not found.\r\n");
   else if (!fs->remove(fsPath))
-    write("450 Cannot delete file.");
+    reply("450 Cannot delete file.\r\n");
   else
-    write("250 File deleted successfully.");
+  {
+    _server->invalidatePath(path);
+    _server->adjustUsedSpace(fs, -(int64_t)st.size);
+    AsyncFTPSidecar::invalidate(*fs, fsPath);
+    reply("250 File deleted successfully.\r\n");
+  }
 }
 
 void AsyncFTPClient::_handleRMD()
@@ -455,14 +859,19 @@ void AsyncFTPClient::_handleRMD()
 
   FS *fs;
   String fsPath;
+  FTPFileStat st;
   if (!_server->resolveFsPath(path, fs, fsPath))
-    write("451 Local error in processing.");
-  else if (!fs->exists(fsPath))
-    write("550 File not found.");
+    reply("451 Local error in processing.\r\n");
+  else if (!_server->stat(path, st))
+    reply("550 File not found.\r\n");
   else if (!fs->rmdir(fsPath))
-    write("550 Failed to delete directory.");
+    reply("550 Failed to delete directory.\r\n");
   else
-    write("250 Directory succesfully deleted.");
+  {
+    _server->invalidatePath(path);
+    _server->adjustUsedSpace(fs, 0);
+    reply("250 Directory succesfully deleted.\r\n");
+  }
 }
 
 void AsyncFTPClient::_handleMKD()
@@ -479,38 +888,82 @@ void AsyncFTPClient::_handleMKD()
 
   FS *fs;
   String fsPath;
+  FTPFileStat st;
   if (!_server->resolveFsPath(path, fs, fsPath))
-    write("451 Local error in processing.");
-  else if (fs->exists(fsPath))
-    write("553 File name already exists.");
-  else if (!fs->mkdir(fsPath))
-    write("550 Failed to create directory.");
+    reply("451 Local error in processing.\r\n");
+  else if (_server->stat(path, st))
+    reply("553 File name already exists.\r\n");
   else
-    write("257 \"" + path + "\" created.");
+  {
+    bool created = fs->mkdir(fsPath);
+    _server->invalidatePath(path);
+    _server->adjustUsedSpace(fs, 0);
+    if (created)
+      writef("257 \"%s\" created.", path.c_str());
+    else
+      reply("550 Failed to create directory.\r\n");
+  }
 }
 
 void AsyncFTPClient::_handlePWD()
 {
-  write("257 \"" + _cwd + "\" is current directory.");
+  writef("257 \"%s\" is current directory.", _cwd.c_str());
 }
 
 void AsyncFTPClient::_handleSYST()
 {
-  write("215 UNIX Type: L8.");
+  reply("215 UNIX Type: L8.\r\n");
 }
 
 void AsyncFTPClient::_handleSTAT()
 {
+  AsyncFTPJob *job = _server->findJob(this);
+  reply("211-Status:\r\n");
+  if (job)
+    write(" " + job->status());
+  writef(" Uploads: %llu bytes received, %llu bytes written.", (unsigned long long)_uploadReceived,
+         (unsigned long long)_uploadWritten);
+  reply("211 End of status.\r\n");
+}
+
+void AsyncFTPClient::_handleABOR()
+{
+  AsyncFTPJob *job = _server->findJob(this);
+  if (job)
+  {
+    job->cancel();
+    reply("226 Abort successful.\r\n");
+  }
+  else
+    reply("225 No operation to abort.\r\n");
 }
 
 void AsyncFTPClient::_handleFEAT()
 {
-  write("211-Features:\r\n");
-  write(" PASV\r\n");
-  write(" SIZE\r\n");
-  write(" UTF8\r\n");
-  write(" TVFS\r\n");
-  write("211 End\r\n");
+  reply("211-Features:\r\n"
+        " PASV\r\n"
+        " SIZE\r\n"
+        " REST STREAM\r\n"
+        " RANG STREAM\r\n"
+        " MLST type*;size*;modify*;perm*;\r\n"
+        " UTF8\r\n"
+        " TVFS\r\n"
+        " MODE Z\r\n");
+
+  // The session's current HASH algorithm is marked with a star.
+  String hash = " HASH ";
+  const FTPHashAlgorithm algorithms[] = {FTP_HASH_SHA256, FTP_HASH_MD5, FTP_HASH_CRC32};
+  for (FTPHashAlgorithm algorithm : algorithms)
+  {
+    if (algorithm != FTP_HASH_SHA256)
+      hash += ";";
+    hash += AsyncFTPDigest::name(algorithm);
+    if (algorithm == _hashAlgorithm)
+      hash += "*";
+  }
+  write(hash);
+
+  reply("211 End\r\n");
 }
 
 void AsyncFTPClient::_handleCommand()
@@ -522,75 +975,153 @@ void AsyncFTPClient::_handleCommand()
     return;
   }
 
-  String cmd = _command.getWord();
+  uint32_t verb = _command.getVerb();
 
   // Serial.print("FTP: ");
   // Serial.print(_command.peekLine());
 
-  if (cmd.equalsIgnoreCase("CWD"))
+  // The final reply of a running job is still outstanding.
+  if (verb != ftpVerb("NOOP") && verb != ftpVerb("STAT") && verb != ftpVerb("ABOR") &&
+      verb != ftpVerb("QUIT") && _server->findJob(this))
+  {
+    reply("450 Operation in progress.\r\n");
+    return;
+  }
+
+  // XSHA256 is too long to pack into a verb.
+  if (!verb && _command.verbToken().equalsIgnoreCase("XSHA256"))
   {
-    String path = _command.getRest();
-    _handleCWD(path);
+    _handleHASH(FTP_HASH_SHA256, true);
+    return;
   }
-  else if (cmd.equalsIgnoreCase("CDUP"))
+
+  switch (verb)
+  {
+  case ftpVerb("CWD"):
+    _handleCWD(_command.getRest());
+    break;
+  case ftpVerb("CDUP"):
     _handleCWD("..");
+    break;
 
   // Logout
-  else if (cmd.equalsIgnoreCase("QUIT"))
+  case ftpVerb("QUIT"):
     _handleQUIT();
+    break;
 
   // Transfer parameters
-  else if (cmd.equalsIgnoreCase("PASV"))
+  case ftpVerb("PASV"):
     _handlePASV();
-  else if (cmd.equalsIgnoreCase("TYPE"))
+    break;
+  case ftpVerb("TYPE"):
     _handleTYPE();
-  else if (cmd.equalsIgnoreCase("OPTS"))
+    break;
+  case ftpVerb("MODE"):
+    _handleMODE();
+    break;
+  case ftpVerb("OPTS"):
     _handleOPTS();
+    break;
 
   // File action commands
-  else if (cmd.equalsIgnoreCase("STOR"))
+  case ftpVerb("STOR"):
     _handleSTOR();
-  else if (cmd.equalsIgnoreCase("SIZE"))
+    break;
+  case ftpVerb("APPE"):
+    _handleSTOR(FTP_COMMAND_APPE);
+    break;
+  case ftpVerb("SIZE"):
     _handleSIZE();
-  else if (cmd.equalsIgnoreCase("RETR"))
+    break;
+  case ftpVerb("RETR"):
     _handleRETR();
-  else if (cmd.equalsIgnoreCase("LIST"))
+    break;
+  case ftpVerb("REST"):
+    _handleREST();
+    break;
+  case ftpVerb("RANG"):
+    _handleRANG();
+    break;
+  case ftpVerb("LIST"):
     _handleLIST();
-  else if (cmd.equalsIgnoreCase("RNFR"))
+    break;
+  case ftpVerb("MLSD"):
+    _handleLIST(FTP_COMMAND_MLSD);
+    break;
+  case ftpVerb("MLST"):
+    _handleMLST();
+    break;
+  case ftpVerb("RNFR"):
     _handleRNFR();
-  else if (cmd.equalsIgnoreCase("RNTO"))
+    break;
+  case ftpVerb("RNTO"):
     _handleRNTO();
-  else if (cmd.equalsIgnoreCase("DELE"))
+    break;
+  case ftpVerb("DELE"):
     _handleDELE();
-  else if (cmd.equalsIgnoreCase("RMD"))
+    break;
+  case ftpVerb("RMD"):
     _handleRMD();
-  else if (cmd.equalsIgnoreCase("MKD"))
+    break;
+  case ftpVerb("MKD"):
     _handleMKD();
-  else if (cmd.equalsIgnoreCase("PWD"))
+    break;
+  case ftpVerb("PWD"):
     _handlePWD();
+    break;
+  case ftpVerb("SITE"):
+    _handleSITE();
+    break;
+  case ftpVerb("ABOR"):
+    _handleABOR();
+    break;
+  case ftpVerb("HASH"):
+    _handleHASH(_hashAlgorithm, false);
+    break;
+  // Nonstandard, so an application may already implement them itself.
+  case ftpVerb("XCRC"):
+    if (!_server->dispatchCommand(verb, this))
+      _handleHASH(FTP_HASH_CRC32, true);
+    break;
+  case ftpVerb("XMD5"):
+    if (!_server->dispatchCommand(verb, this))
+      _handleHASH(FTP_HASH_MD5, true);
+    break;
 
   // Informational commands
-  else if (cmd.equalsIgnoreCase("SYST"))
+  case ftpVerb("SYST"):
     _handleSYST();
-  else if (cmd.equalsIgnoreCase("FEAT"))
+    break;
+  case ftpVerb("FEAT"):
     _handleFEAT();
+    break;
+  case ftpVerb("STAT"):
+    _handleSTAT();
+    break;
 
   // Miscellaneous commands
-  else if (cmd.equalsIgnoreCase("NOOP"))
-    write("200 Ok.");
+  case ftpVerb("NOOP"):
+    reply("200 Ok.\r\n");
+    break;
 
-  // Not implemented commands
-  else
-  {
-    // Serial.print(" (not implemented)");
-    write("502 Command not implemented.");
+  // Application commands, then not implemented commands
+  default:
+    if (!_server->dispatchCommand(verb, this))
+    {
+      // Serial.print(" (not implemented)");
+      reply("502 Command not implemented.\r\n");
+    }
+    break;
   }
 
   // Serial.println();
 }
 
 AsyncFTPClient::AsyncFTPClient(AsyncFTPServer *s, AsyncClient *c)
-    : _server(s), _client(c)
+    : _server(s), _client(c),
+      _rxLowWatermark(s->receiveLowWatermark()),
+      _rxHighWatermark(s->receiveHighWatermark()),
+      _skipIdentical(s->skipIdentical())
 {
   c->onTimeout(
       [](void *, AsyncClient *c, uint32_t)
@@ -603,34 +1134,59 @@ AsyncFTPClient::AsyncFTPClient(AsyncFTPServer *s, AsyncClient *c)
       [](void *s, AsyncClient *, void *buf, size_t len)
       {
         // async_ws_log_e("AsyncFTPClient::_onData");
-        static_cast<AsyncFTPClient *>(s)->_onData(buf, len);
+        AsyncFTPClient *client = static_cast<AsyncFTPClient *>(s);
+        AsyncFTPLock lock(client->_server);
+        client->_onData(buf, len);
       },
       this);
 
-  c->onDisconnect(
+  c->onPoll(
       [](void *s, AsyncClient *)
+      {
+        AsyncFTPClient *client = static_cast<AsyncFTPClient *>(s);
+        AsyncFTPLock lock(client->_server);
+        client->_onPoll();
+      },
+      this);
+
+  c->onDisconnect(
+      [](void *s, AsyncClient *c)
       {
         // async_ws_log_e("AsyncFTPClient::_onDisconnect");
-        delete static_cast<AsyncFTPClient *>(s);
+        AsyncFTPClient *client = static_cast<AsyncFTPClient *>(s);
+        AsyncFTPLock lock(client->_server);
+        delete client;
+        delete c;
       },
       this);
 
-  write("220 Service ready for new user.");
+  reply("220 Service ready for new user.\r\n");
 }
 
 AsyncFTPClient::~AsyncFTPClient()
 {
+  _server->detachJobs(this);
+
   if (_pasiveServer)
   {
-    _pasiveServer->end();
-    delete _pasiveServer;
+    _server->releasePassive(_pasiveServer);
     _pasiveServer = nullptr;
   }
 
+  for (size_t i = 0; i < _dataChannelCount; i++)
+    _server->releasePassive(_dataChannels[i]);
+  _dataChannelCount = 0;
+
   if (_client)
     _client = nullptr;
 }
 
+void AsyncFTPClient::recordUpload(size_t received, size_t written)
+{
+  _uploadReceived += received;
+  _uploadWritten += written;
+}
+
 void AsyncFTPClient::write(String message)
 {
   write(message.c_str());
@@ -638,9 +1194,79 @@ void AsyncFTPClient::write(String message)
 
 void AsyncFTPClient::write(const char *data)
 {
-  char response[strlen(data) + 3];
-  sprintf(response, "%s\r\n", data);
-  _client->write(response);
+  _queueReply(data, strlen(data));
+  _queueReply("\r\n", 2);
+  if (!_replyBatch)
+    flush();
+}
+
+void AsyncFTPClient::writef(const char *format, ...)
+{
+  if (sizeof(_replyBuf) - _replyLen < FTP_REPLY_LINE_MAX)
+    flush();
+
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(_replyBuf + _replyLen, FTP_REPLY_LINE_MAX - 2, format, args);
+  va_end(args);
+
+  if (len > 0)
+    _replyLen += (size_t)len < FTP_REPLY_LINE_MAX - 2 ? len : FTP_REPLY_LINE_MAX - 3;
+  _queueReply("\r\n", 2);
+
+  if (!_replyBatch)
+    flush();
+}
+
+void AsyncFTPClient::_queueReply(const char *data, size_t len)
+{
+  if (_replyLen + len > sizeof(_replyBuf))
+  {
+    flush();
+    if (len > sizeof(_replyBuf))
+    {
+      _client->write(data, len);
+      return;
+    }
+  }
+
+  memcpy(_replyBuf + _replyLen, data, len);
+  _replyLen += len;
+}
+
+void AsyncFTPClient::flush()
+{
+  if (!_replyLen)
+    return;
+
+  _client->write(_replyBuf, _replyLen);
+  _replyLen = 0;
+}
+
+void AsyncFTPClient::setReceiveWatermarks(size_t low, size_t high)
+{
+  _rxLowWatermark = low < high ? low : high;
+  _rxHighWatermark = high;
+}
+
+size_t AsyncFTPClient::receiveLowWatermark() const
+{
+  return _rxLowWatermark;
+}
+
+size_t AsyncFTPClient::receiveHighWatermark() const
+{
+  return _rxHighWatermark;
+}
+
+FTPTransmissionMode AsyncFTPClient::transmissionMode() const
+{
+  return _mode;
+}
+
+AsyncFTPCommand &AsyncFTPClient::command()
+{
+  return _command;
 }
 
 IPAddress AsyncFTPClient::localIP()
@@ -1,15 +1,50 @@
 #include "ESPAsyncFTPServer.h"
 
-void AsyncFTPCommand::write(const void *data, size_t len)
+bool FTPToken::equalsIgnoreCase(const char *s) const
 {
-  if (!data || !len)
-    return;
-  _buffer.concat((const char *)data, len);
+  return strlen(s) == length && strncasecmp(data, s, length) == 0;
+}
+
+String FTPToken::toString() const
+{
+  String str;
+  if (length)
+    str.concat(data, length);
+  return str;
+}
+
+size_t AsyncFTPCommand::write(const void *data, size_t len)
+{
+  if (!data || _hasLine)
+    return 0;
+
+  const char *p = (const char *)data;
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = p[i];
+
+    if (c == '\n')
+    {
+      if (_length && _buffer[_length - 1] == '\r')
+        _length--;
+      _buffer[_length] = '\0';
+      _hasLine = true;
+      return i + 1;
+    }
+
+    // Keep scanning for the end of an overlong line, but drop its bytes.
+    if (_length < FTP_COMMAND_LINE_MAX)
+      _buffer[_length++] = c;
+    else
+      _overflow = true;
+  }
+
+  return len;
 }
 
 bool AsyncFTPCommand::eof() const
 {
-  return _index >= _buffer.length();
+  return !_hasLine || _index >= _length;
 }
 
 void AsyncFTPCommand::skipWs()
@@ -18,59 +53,79 @@ void AsyncFTPCommand::skipWs()
     _index++;
 }
 
-String AsyncFTPCommand::getWord()
+uint32_t AsyncFTPCommand::getVerb()
 {
-  if (eof())
-    return "";
+  _verb = word();
+  if (_verb.length > 4)
+    return 0;
+
+  uint32_t packed = 0;
+  for (size_t i = 0; i < _verb.length; i++)
+    packed = ftpVerbPack(packed, _verb.data[i]);
+  return packed;
+}
+
+const FTPToken &AsyncFTPCommand::verbToken() const
+{
+  return _verb;
+}
 
+FTPToken AsyncFTPCommand::word()
+{
   skipWs();
 
   size_t start = _index;
-
-  while (!eof())
-  {
-    char c = _buffer[_index];
-    if (c == ' ' || c == '\r' || c == '\n')
-      break;
+  while (!eof() && _buffer[_index] != ' ')
     _index++;
-  }
 
-  return _buffer.substring(start, _index);
+  return FTPToken(_buffer + start, _index - start);
 }
 
-String AsyncFTPCommand::getRest()
+FTPToken AsyncFTPCommand::rest()
 {
-  if (eof())
-    return "";
-
   skipWs();
 
-  int lineEnd = _buffer.indexOf("\r\n", _index);
-  if (lineEnd < 0)
-    lineEnd = _buffer.length();
+  size_t start = _index;
+  _index = _length;
+
+  return FTPToken(_buffer + start, _length - start);
+}
+
+String AsyncFTPCommand::getWord()
+{
+  return word().toString();
+}
 
-  String rest = _buffer.substring(_index, lineEnd);
-  _index = lineEnd;
+String AsyncFTPCommand::getRest()
+{
+  return rest().toString();
+}
 
-  return rest;
+void AsyncFTPCommand::rewind()
+{
+  _index = _verb.data ? _verb.data - _buffer + _verb.length : 0;
 }
 
 bool AsyncFTPCommand::hasLine() const
 {
-  return _buffer.indexOf("\r\n") >= 0;
+  return _hasLine;
+}
+
+bool AsyncFTPCommand::lineTooLong() const
+{
+  return _overflow;
 }
 
 String AsyncFTPCommand::peekLine()
 {
-  return _buffer.substring(0, _buffer.indexOf("\r\n"));
+  return _hasLine ? String(_buffer) : String();
 }
 
 void AsyncFTPCommand::nextLine()
 {
-  int end = _buffer.indexOf("\r\n");
-  if (end >= 0)
-  {
-    _buffer.remove(0, end + 2);
-    _index = 0;
-  }
+  _length = 0;
+  _index = 0;
+  _hasLine = false;
+  _overflow = false;
+  _verb = FTPToken();
 }
@@ -0,0 +1,116 @@
+#include "ESPAsyncFTPServer.h"
+
+AsyncFTPCopyJob::~AsyncFTPCopyJob()
+{
+  _client = nullptr;
+  if (!_done && _dst)
+    _finish("426 Copy aborted.");
+}
+
+bool AsyncFTPCopyJob::begin(const String &from, const String &to)
+{
+  if (!_server->resolveFsPath(from, _srcFs, _srcPath) || !_server->resolveFsPath(to, _dstFs, _dstPath))
+    return false;
+
+  _src = _srcFs->open(_srcPath, FILE_READ);
+  if (!_src || _src.isDirectory())
+  {
+    _src.close();
+    return false;
+  }
+
+  _size = _src.size();
+  if (_server->freeSpace(_dstFs) < _size)
+  {
+    _src.close();
+    return false;
+  }
+
+  _dst = _dstFs->open(_dstPath, FILE_WRITE);
+  if (!_dst)
+  {
+    _src.close();
+    return false;
+  }
+
+  _from = from;
+  _to = to;
+  _server->invalidatePath(_to);
+  return true;
+}
+
+bool AsyncFTPCopyJob::step()
+{
+  if (_done)
+    return false;
+
+  size_t size = _src.read(_buf, sizeof(_buf));
+  if (size && _dst.write(_buf, size) != size)
+  {
+    _finish("452 Insufficient storage space.");
+    return false;
+  }
+
+  _copied += size;
+  if (!size || _copied >= _size)
+    _finish(_copied == _size ? nullptr : "451 Local error in processing.");
+
+  return !_done;
+}
+
+void AsyncFTPCopyJob::_finish(const char *error)
+{
+  _src.close();
+  _dst.close();
+  _done = true;
+
+  if (error)
+    _dstFs->remove(_dstPath);
+  else
+  {
+    _server->adjustUsedSpace(_dstFs, _size);
+    if (_move && _srcFs->remove(_srcPath))
+      _server->adjustUsedSpace(_srcFs, -(int64_t)_size);
+  }
+
+  _server->invalidatePath(_to);
+  if (_move)
+    _server->invalidatePath(_from);
+
+  if (!_client)
+    return;
+
+  if (error)
+    _client->write(error);
+  else if (_move)
+    _client->reply("250 File renamed successfully.\r\n");
+  else
+    _client->reply("250 File copied.\r\n");
+}
+
+void AsyncFTPCopyJob::cancel()
+{
+  if (!_done)
+    _finish("426 Copy aborted.");
+}
+
+String AsyncFTPCopyJob::status() const
+{
+  return String(_move ? "Moving " : "Copying ") + _from + ": " + String((unsigned)_copied) + " of " +
+         String((unsigned)_size) + " bytes.";
+}
+
+bool AsyncFTPCopyJob::move() const
+{
+  return _move;
+}
+
+size_t AsyncFTPCopyJob::size() const
+{
+  return _size;
+}
+
+size_t AsyncFTPCopyJob::copied() const
+{
+  return _copied;
+}
@@ -0,0 +1,289 @@
+#include "ESPAsyncFTPServer.h"
+
+// Single fixed-Huffman block with greedy single-candidate matching; this
+// keeps the encoder state to the window plus one hash head table.
+
+static const uint16_t LENGTH_BASE[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                       31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                       2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                     193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                     6145, 8193, 12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+#define DEFLATE_MIN_LOOKAHEAD (DEFLATE_MAX_MATCH + DEFLATE_MIN_MATCH + 1)
+
+enum
+{
+  DEFLATE_HEADER,
+  DEFLATE_DATA,
+  DEFLATE_TRAILER,
+  DEFLATE_DONE,
+};
+
+static uint16_t reverseBits(uint16_t code, uint8_t len)
+{
+  uint16_t rev = 0;
+  while (len--)
+  {
+    rev = (rev << 1) | (code & 1);
+    code >>= 1;
+  }
+  return rev;
+}
+
+AsyncFTPDeflate::~AsyncFTPDeflate()
+{
+  end();
+}
+
+bool AsyncFTPDeflate::begin(uint8_t windowBits, uint8_t hashBits)
+{
+  end();
+
+  // Below 1 KiB a listing line could not fit next to the match lookahead.
+  if (windowBits < 10)
+    windowBits = 10;
+  if (windowBits > 15)
+    windowBits = 15;
+
+  _windowBits = windowBits;
+  _windowSize = (size_t)1 << windowBits;
+  _hashBits = hashBits;
+
+  _window = (uint8_t *)malloc(_windowSize * 2);
+  _head = (uint16_t *)calloc((size_t)1 << hashBits, sizeof(uint16_t));
+  if (!_window || !_head)
+  {
+    end();
+    return false;
+  }
+
+  _pos = 0;
+  _end = 0;
+  _adler = 1;
+  _bitBuf = 0;
+  _bitCount = 0;
+  _state = DEFLATE_HEADER;
+  _totalIn = 0;
+  _totalOut = 0;
+  return true;
+}
+
+void AsyncFTPDeflate::end()
+{
+  free(_window);
+  free(_head);
+  _window = nullptr;
+  _head = nullptr;
+}
+
+uint8_t *AsyncFTPDeflate::inputBuffer(size_t &space)
+{
+  // Slide once the encoder is a full window in, so history stays available.
+  if (_pos >= _windowSize)
+  {
+    memmove(_window, _window + _windowSize, _end - _windowSize);
+    _pos -= _windowSize;
+    _end -= _windowSize;
+
+    size_t count = (size_t)1 << _hashBits;
+    for (size_t i = 0; i < count; i++)
+      _head[i] = _head[i] >= _windowSize ? _head[i] - _windowSize : 0;
+  }
+
+  space = _state == DEFLATE_DATA || _state == DEFLATE_HEADER ? _windowSize * 2 - _end : 0;
+  return _window + _end;
+}
+
+void AsyncFTPDeflate::commitInput(size_t len)
+{
+  const uint8_t *data = _window + _end;
+  uint32_t a = _adler & 0xFFFF;
+  uint32_t b = _adler >> 16;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    a += data[i];
+    if (a >= 65521)
+      a -= 65521;
+    b += a;
+    if (b >= 65521)
+      b -= 65521;
+  }
+
+  _adler = (b << 16) | a;
+  _end += len;
+  _totalIn += len;
+}
+
+size_t AsyncFTPDeflate::write(const uint8_t *data, size_t len)
+{
+  size_t space;
+  uint8_t *buf = inputBuffer(space);
+  if (len > space)
+    len = space;
+
+  memcpy(buf, data, len);
+  commitInput(len);
+  return len;
+}
+
+void AsyncFTPDeflate::_putBits(uint32_t value, uint8_t count)
+{
+  _bitBuf |= value << _bitCount;
+  _bitCount += count;
+
+  while (_bitCount >= 8)
+  {
+    _out[_outPos++] = _bitBuf & 0xFF;
+    _bitBuf >>= 8;
+    _bitCount -= 8;
+  }
+}
+
+void AsyncFTPDeflate::_putLiteral(uint8_t c)
+{
+  if (c < 144)
+    _putBits(reverseBits(0x30 + c, 8), 8);
+  else
+    _putBits(reverseBits(0x190 + c - 144, 9), 9);
+}
+
+void AsyncFTPDeflate::_putMatch(size_t len, size_t dist)
+{
+  uint8_t code = 0;
+  while (code < 28 && LENGTH_BASE[code + 1] <= len)
+    code++;
+
+  uint16_t sym = 257 + code;
+  if (sym < 280)
+    _putBits(reverseBits(sym - 256, 7), 7);
+  else
+    _putBits(reverseBits(0xC0 + sym - 280, 8), 8);
+  if (LENGTH_EXTRA[code])
+    _putBits(len - LENGTH_BASE[code], LENGTH_EXTRA[code]);
+
+  code = 0;
+  while (code < 29 && DIST_BASE[code + 1] <= dist)
+    code++;
+
+  _putBits(reverseBits(code, 5), 5);
+  if (DIST_EXTRA[code])
+    _putBits(dist - DIST_BASE[code], DIST_EXTRA[code]);
+}
+
+uint32_t AsyncFTPDeflate::_hash(size_t pos) const
+{
+  uint32_t v = ((uint32_t)_window[pos] << 16) | ((uint32_t)_window[pos + 1] << 8) | _window[pos + 2];
+  return (uint32_t)(v * 2654435761u) >> (32 - _hashBits);
+}
+
+size_t AsyncFTPDeflate::read(uint8_t *out, size_t len, bool finish)
+{
+  _out = out;
+  _outPos = 0;
+
+  if (_state == DEFLATE_HEADER)
+  {
+    if (len < 2)
+      return 0;
+
+    uint8_t cmf = ((_windowBits - 8) << 4) | 8;
+    uint8_t flg = (31 - ((cmf << 8) % 31)) % 31;
+    _out[_outPos++] = cmf;
+    _out[_outPos++] = flg;
+
+    // BFINAL = 1, BTYPE = 01 (fixed Huffman): the stream is a single block.
+    _putBits(3, 3);
+    _state = DEFLATE_DATA;
+  }
+
+  // A token never takes more than 5 bytes including pending bits.
+  while (_state == DEFLATE_DATA && len - _outPos >= 6)
+  {
+    size_t lookahead = _end - _pos;
+
+    if (!lookahead)
+    {
+      if (!finish)
+        break;
+
+      _putBits(0, 7);
+      if (_bitCount)
+        _putBits(0, 8 - _bitCount);
+      _state = DEFLATE_TRAILER;
+      break;
+    }
+
+    if (lookahead < DEFLATE_MIN_LOOKAHEAD && !finish)
+      break;
+
+    size_t matchLen = 0;
+    size_t matchDist = 0;
+
+    if (lookahead >= DEFLATE_MIN_MATCH)
+    {
+      uint32_t h = _hash(_pos);
+      size_t cand = _head[h];
+      _head[h] = _pos;
+
+      if (cand < _pos && _pos - cand <= _windowSize)
+      {
+        size_t max = lookahead < DEFLATE_MAX_MATCH ? lookahead : DEFLATE_MAX_MATCH;
+        const uint8_t *a = _window + cand;
+        const uint8_t *b = _window + _pos;
+        while (matchLen < max && a[matchLen] == b[matchLen])
+          matchLen++;
+        matchDist = _pos - cand;
+      }
+    }
+
+    if (matchLen >= DEFLATE_MIN_MATCH)
+    {
+      _putMatch(matchLen, matchDist);
+
+      for (size_t i = 1; i < matchLen; i++)
+        if (_pos + i + DEFLATE_MIN_MATCH <= _end)
+          _head[_hash(_pos + i)] = _pos + i;
+
+      _pos += matchLen;
+    }
+    else
+    {
+      _putLiteral(_window[_pos]);
+      _pos++;
+    }
+  }
+
+  if (_state == DEFLATE_TRAILER && len - _outPos >= 4)
+  {
+    _out[_outPos++] = _adler >> 24;
+    _out[_outPos++] = _adler >> 16;
+    _out[_outPos++] = _adler >> 8;
+    _out[_outPos++] = _adler;
+    _state = DEFLATE_DONE;
+  }
+
+  _totalOut += _outPos;
+  return _outPos;
+}
+
+bool AsyncFTPDeflate::finished() const
+{
+  return _state == DEFLATE_DONE;
+}
+
+size_t AsyncFTPDeflate::totalIn() const
+{
+  return _totalIn;
+}
+
+size_t AsyncFTPDeflate::totalOut() const
+{
+  return _totalOut;
+}
@@ -0,0 +1,363 @@
+#include "ESPAsyncFTPServer.h"
+
+#if defined(ESP32)
+#include <mbedtls/version.h>
+
+// mbedtls 2.x deprecates the plain names in favour of the _ret variants,
+// which 3.x removes again.
+#if MBEDTLS_VERSION_NUMBER < 0x03000000
+#define FTP_SHA256_STARTS mbedtls_sha256_starts_ret
+#define FTP_SHA256_UPDATE mbedtls_sha256_update_ret
+#define FTP_SHA256_FINISH mbedtls_sha256_finish_ret
+#else
+#define FTP_SHA256_STARTS mbedtls_sha256_starts
+#define FTP_SHA256_UPDATE mbedtls_sha256_update
+#define FTP_SHA256_FINISH mbedtls_sha256_finish
+#endif
+#endif
+
+#if !defined(ESP32)
+static const uint32_t sha256K[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+    0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+    0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+    0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+    0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+    0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2};
+
+static inline uint32_t rotr(uint32_t x, uint8_t n)
+{
+  return (x >> n) | (x << (32 - n));
+}
+
+void AsyncFTPDigest::_shaTransform(const uint8_t *block)
+{
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = ((uint32_t)block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+  for (int i = 16; i < 64; i++)
+  {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = _shaState[0], b = _shaState[1], c = _shaState[2], d = _shaState[3];
+  uint32_t e = _shaState[4], f = _shaState[5], g = _shaState[6], h = _shaState[7];
+
+  for (int i = 0; i < 64; i++)
+  {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  _shaState[0] += a;
+  _shaState[1] += b;
+  _shaState[2] += c;
+  _shaState[3] += d;
+  _shaState[4] += e;
+  _shaState[5] += f;
+  _shaState[6] += g;
+  _shaState[7] += h;
+}
+#endif
+
+AsyncFTPDigest::AsyncFTPDigest()
+{
+#if defined(ESP32)
+  mbedtls_sha256_init(&_sha);
+#endif
+}
+
+AsyncFTPDigest::~AsyncFTPDigest()
+{
+#if defined(ESP32)
+  mbedtls_sha256_free(&_sha);
+#endif
+}
+
+void AsyncFTPDigest::begin(FTPHashAlgorithm algorithm)
+{
+  _algorithm = algorithm;
+
+  switch (algorithm)
+  {
+  case FTP_HASH_CRC32:
+    _crc = 0;
+    break;
+
+  case FTP_HASH_MD5:
+    _md5.begin();
+    break;
+
+  case FTP_HASH_SHA256:
+#if defined(ESP32)
+    // Uses the SHA accelerator when mbedtls is built with hardware support.
+    mbedtls_sha256_free(&_sha);
+    mbedtls_sha256_init(&_sha);
+    FTP_SHA256_STARTS(&_sha, 0);
+#else
+    static const uint32_t init[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                     0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+    memcpy(_shaState, init, sizeof(_shaState));
+    _shaLength = 0;
+#endif
+    break;
+  }
+}
+
+void AsyncFTPDigest::update(const uint8_t *data, size_t len)
+{
+  switch (_algorithm)
+  {
+  case FTP_HASH_CRC32:
+    _crc = crc32(_crc, data, len);
+    break;
+
+  case FTP_HASH_MD5:
+    // MD5Builder takes at most 64 KiB per call on older cores.
+    while (len)
+    {
+      uint16_t chunk = len > 0x8000 ? 0x8000 : len;
+      _md5.add((uint8_t *)data, chunk);
+      data += chunk;
+      len -= chunk;
+    }
+    break;
+
+  case FTP_HASH_SHA256:
+#if defined(ESP32)
+    FTP_SHA256_UPDATE(&_sha, data, len);
+#else
+    while (len)
+    {
+      size_t used = _shaLength % 64;
+      size_t chunk = 64 - used < len ? 64 - used : len;
+      memcpy(_shaBlock + used, data, chunk);
+      _shaLength += chunk;
+      data += chunk;
+      len -= chunk;
+      if (used + chunk == 64)
+        _shaTransform(_shaBlock);
+    }
+#endif
+    break;
+  }
+}
+
+String AsyncFTPDigest::finish()
+{
+  uint8_t digest[32];
+  size_t size = 0;
+
+  switch (_algorithm)
+  {
+  case FTP_HASH_CRC32:
+    for (int i = 0; i < 4; i++)
+      digest[i] = _crc >> (24 - i * 8);
+    size = 4;
+    break;
+
+  case FTP_HASH_MD5:
+    _md5.calculate();
+    return _md5.toString();
+
+  case FTP_HASH_SHA256:
+#if defined(ESP32)
+    FTP_SHA256_FINISH(&_sha, digest);
+#else
+    {
+      uint64_t bits = _shaLength * 8;
+      uint8_t pad = 0x80;
+      update(&pad, 1);
+      pad = 0;
+      while (_shaLength % 64 != 56)
+        update(&pad, 1);
+
+      uint8_t length[8];
+      for (int i = 0; i < 8; i++)
+        length[i] = bits >> (56 - i * 8);
+      update(length, sizeof(length));
+
+      for (int i = 0; i < 32; i++)
+        digest[i] = _shaState[i / 4] >> (24 - (i % 4) * 8);
+    }
+#endif
+    size = 32;
+    break;
+  }
+
+  static const char hex[] = "0123456789abcdef";
+  String out;
+  out.reserve(size * 2);
+  for (size_t i = 0; i < size; i++)
+  {
+    out.concat(hex[digest[i] >> 4]);
+    out.concat(hex[digest[i] & 0x0F]);
+  }
+  return out;
+}
+
+uint32_t AsyncFTPDigest::crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+      0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+  crc = ~crc;
+  while (len--)
+  {
+    crc ^= *data++;
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+    crc = (crc >> 4) ^ table[crc & 0x0F];
+  }
+  return ~crc;
+}
+
+const char *AsyncFTPDigest::name(FTPHashAlgorithm algorithm)
+{
+  switch (algorithm)
+  {
+  case FTP_HASH_CRC32:
+    return "CRC32";
+  case FTP_HASH_MD5:
+    return "MD5";
+  default:
+    return "SHA-256";
+  }
+}
+
+String AsyncFTPDigest::sidecarPath(const String &path)
+{
+  return path + FTP_DIGEST_SUFFIX;
+}
+
+// First line of every sidecar this class writes.
+static const char SIDECAR_MARKER[] = "# ESPAsyncFTPServer digests\n";
+
+// Reads the lines after the marker into buf; empty if there is no sidecar.
+// False if the file exists but was not written here.
+static bool readSidecar(FS &fs, const String &path, char *buf, size_t len)
+{
+  buf[0] = 0;
+  if (!fs.exists(path))
+    return true;
+
+  File file = fs.open(path, FILE_READ);
+  size_t size = file ? file.read((uint8_t *)buf, len - 1) : 0;
+  file.close();
+  buf[size] = 0;
+
+  size_t marker = sizeof(SIDECAR_MARKER) - 1;
+  if (size < marker || memcmp(buf, SIDECAR_MARKER, marker))
+  {
+    buf[0] = 0;
+    return false;
+  }
+  memmove(buf, buf + marker, size - marker + 1);
+  return true;
+}
+
+// "<algorithm> <digest> <size> <last write>"
+static bool parseSidecarLine(char *line, FTPHashAlgorithm &algorithm, char *digest, FTPFileStat &st)
+{
+  char name[16];
+  unsigned long size;
+  long long lastWrite;
+  if (sscanf(line, "%15s %64s %lu %lld", name, digest, &size, &lastWrite) != 4 ||
+      !AsyncFTPDigest::parse(name, algorithm))
+    return false;
+
+  st.size = size;
+  st.lastWrite = lastWrite;
+  return true;
+}
+
+bool AsyncFTPDigest::loadSidecar(FS &fs, const String &path, FTPHashAlgorithm algorithm, const FTPFileStat &st,
+                                 String &digest)
+{
+  char buf[FTP_DIGEST_SIDECAR_MAX];
+  if (!readSidecar(fs, sidecarPath(path), buf, sizeof(buf)) || !buf[0])
+    return false;
+
+  char *save;
+  for (char *line = strtok_r(buf, "\n", &save); line; line = strtok_r(nullptr, "\n", &save))
+  {
+    FTPHashAlgorithm lineAlgorithm;
+    FTPFileStat lineStat;
+    char hex[65];
+    if (parseSidecarLine(line, lineAlgorithm, hex, lineStat) && lineAlgorithm == algorithm &&
+        lineStat.size == st.size && lineStat.lastWrite == st.lastWrite)
+    {
+      digest = hex;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool AsyncFTPDigest::storeSidecar(FS &fs, const String &path, FTPHashAlgorithm algorithm, const String &digest,
+                                  const FTPFileStat &st)
+{
+  String sidecar = sidecarPath(path);
+  char buf[FTP_DIGEST_SIDECAR_MAX];
+  String out = SIDECAR_MARKER;
+
+  // Digests of other algorithms stay while they describe the same version.
+  if (!readSidecar(fs, sidecar, buf, sizeof(buf)))
+    return false;
+  char *save;
+  for (char *line = strtok_r(buf, "\n", &save); line; line = strtok_r(nullptr, "\n", &save))
+  {
+    FTPHashAlgorithm lineAlgorithm;
+    FTPFileStat lineStat;
+    char hex[65];
+    if (parseSidecarLine(line, lineAlgorithm, hex, lineStat) && lineAlgorithm != algorithm &&
+        lineStat.size == st.size && lineStat.lastWrite == st.lastWrite)
+      out += String(line) + "\n";
+  }
+
+  char line[128];
+  snprintf(line, sizeof(line), "%s %s %lu %lld\n", name(algorithm), digest.c_str(), (unsigned long)st.size,
+           (long long)st.lastWrite);
+  out += line;
+
+  File file = fs.open(sidecar, FILE_WRITE);
+  bool written = file && file.write((const uint8_t *)out.c_str(), out.length()) == out.length();
+  file.close();
+  if (!written)
+    fs.remove(sidecar);
+  return written;
+}
+
+bool AsyncFTPDigest::removeSidecar(FS &fs, const String &path)
+{
+  String sidecar = sidecarPath(path);
+  char buf[FTP_DIGEST_SIDECAR_MAX];
+
+  // Only remove files this class wrote; a user's own file of that name stays.
+  return fs.exists(sidecar) && readSidecar(fs, sidecar, buf, sizeof(buf)) && fs.remove(sidecar);
+}
+
+bool AsyncFTPDigest::parse(const String &name, FTPHashAlgorithm &algorithm)
+{
+  if (name.equalsIgnoreCase("CRC32"))
+    algorithm = FTP_HASH_CRC32;
+  else if (name.equalsIgnoreCase("MD5"))
+    algorithm = FTP_HASH_MD5;
+  else if (name.equalsIgnoreCase("SHA-256"))
+    algorithm = FTP_HASH_SHA256;
+  else
+    return false;
+  return true;
+}
@@ -0,0 +1,84 @@
+#include "ESPAsyncFTPServer.h"
+
+bool AsyncFTPHashJob::begin(const String &path, size_t offset, size_t length)
+{
+  FS *fs;
+  String fsPath;
+  if (!_server->resolveFsPath(path, fs, fsPath))
+    return false;
+
+  _file = fs->open(fsPath, FILE_READ);
+  if (!_file || _file.isDirectory() || offset > _file.size() || (offset && !_file.seek(offset)))
+  {
+    _file.close();
+    return false;
+  }
+
+  size_t available = _file.size() - offset;
+  _path = path;
+  _start = offset;
+  _size = length < available ? length : available;
+  _whole = !offset && _size == _file.size();
+  _generation = _server->cacheGeneration();
+  _digest.begin(_algorithm);
+  return true;
+}
+
+bool AsyncFTPHashJob::step()
+{
+  if (_done)
+    return false;
+
+  size_t size = _size - _hashed < sizeof(_buf) ? _size - _hashed : sizeof(_buf);
+  size = size ? _file.read(_buf, size) : 0;
+  _digest.update(_buf, size);
+  _hashed += size;
+
+  if (size && _hashed < _size)
+    return true;
+
+  _file.close();
+  _done = true;
+
+  if (_hashed != _size)
+  {
+    if (_client)
+      _client->reply("451 Local error in processing.\r\n");
+    return false;
+  }
+
+  String digest = _digest.finish();
+  if (_whole)
+    _server->storeDigest(_path, _algorithm, digest, _generation, false);
+  if (_client)
+    _client->write(formatReply(_extended, _algorithm, _start, _size, digest, _path));
+  return false;
+}
+
+void AsyncFTPHashJob::cancel()
+{
+  if (_done)
+    return;
+
+  _file.close();
+  _done = true;
+  if (_client)
+    _client->reply("426 Checksum aborted.\r\n");
+}
+
+String AsyncFTPHashJob::status() const
+{
+  return String("Hashing ") + _path + ": " + String((unsigned)_hashed) + " of " + String((unsigned)_size) +
+         " bytes.";
+}
+
+String AsyncFTPHashJob::formatReply(bool extended, FTPHashAlgorithm algorithm, size_t start, size_t size,
+                                    const String &digest, const String &path)
+{
+  if (extended)
+    return "250 " + digest;
+
+  size_t end = size ? start + size - 1 : start;
+  return String("213 ") + AsyncFTPDigest::name(algorithm) + " " + String((unsigned)start) + "-" +
+         String((unsigned)end) + " " + digest + " " + path;
+}
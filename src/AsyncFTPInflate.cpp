@@ -0,0 +1,463 @@
+#include "ESPAsyncFTPServer.h"
+
+// Resumable zlib/deflate decoder. Input is pulled into a 64-bit bit buffer
+// and every step is undone when it runs out of bits, so a step never has
+// to be continued across TCP segments.
+
+static const uint16_t LENGTH_BASE[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27,
+                                       31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LENGTH_EXTRA[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                       2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DIST_BASE[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+                                     193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+                                     6145, 8193, 12289, 16385, 24577};
+static const uint8_t DIST_EXTRA[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+                                     6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const uint8_t CODE_LENGTH_ORDER[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+enum
+{
+  INFLATE_HEADER,
+  INFLATE_BLOCK,
+  INFLATE_STORED_HEADER,
+  INFLATE_STORED,
+  INFLATE_TABLE_HEADER,
+  INFLATE_CODE_LENGTHS,
+  INFLATE_LENGTHS,
+  INFLATE_CODES,
+  INFLATE_TRAILER,
+  INFLATE_DONE,
+  INFLATE_ERROR,
+};
+
+enum
+{
+  STEP_OK,
+  STEP_NEED_INPUT,
+  STEP_OUTPUT_FULL,
+  STEP_ERROR,
+};
+
+AsyncFTPInflate::~AsyncFTPInflate()
+{
+  end();
+}
+
+bool AsyncFTPInflate::begin(uint8_t windowBits)
+{
+  end();
+
+  if (windowBits < 9)
+    windowBits = 9;
+  if (windowBits > 15)
+    windowBits = 15;
+
+  _windowBits = windowBits;
+  _windowSize = (size_t)1 << windowBits;
+  _window = (uint8_t *)malloc(_windowSize);
+  if (!_window)
+    return false;
+
+  _wpos = 0;
+  _flushPos = 0;
+  _pending = 0;
+  _total = 0;
+  _bitBuf = 0;
+  _bitCount = 0;
+  _state = INFLATE_HEADER;
+  _final = false;
+  _adler = 1;
+  return true;
+}
+
+void AsyncFTPInflate::end()
+{
+  free(_window);
+  _window = nullptr;
+}
+
+bool AsyncFTPInflate::_build(uint16_t *count, uint16_t *symbol, const uint8_t *lengths, size_t n)
+{
+  uint16_t offs[16];
+
+  memset(count, 0, 16 * sizeof(uint16_t));
+  for (size_t i = 0; i < n; i++)
+    count[lengths[i]]++;
+
+  if (count[0] == n)
+    return true;
+
+  int left = 1;
+  for (int len = 1; len < 16; len++)
+  {
+    left <<= 1;
+    left -= count[len];
+    if (left < 0)
+      return false;
+  }
+
+  offs[1] = 0;
+  for (int len = 1; len < 15; len++)
+    offs[len + 1] = offs[len] + count[len];
+
+  for (size_t i = 0; i < n; i++)
+    if (lengths[i])
+      symbol[offs[lengths[i]]++] = i;
+
+  return true;
+}
+
+bool AsyncFTPInflate::_bits(uint8_t n, uint32_t &value)
+{
+  if (_bitCount < n)
+    return false;
+
+  value = _bitBuf & (((uint64_t)1 << n) - 1);
+  _bitBuf >>= n;
+  _bitCount -= n;
+  return true;
+}
+
+int AsyncFTPInflate::_decode(const uint16_t *count, const uint16_t *symbol)
+{
+  int code = 0;
+  int first = 0;
+  int index = 0;
+
+  for (uint8_t len = 1; len < 16; len++)
+  {
+    if (_bitCount < len)
+      return -1;
+
+    code |= (_bitBuf >> (len - 1)) & 1;
+    int n = count[len];
+    if (code - n < first)
+    {
+      _bitBuf >>= len;
+      _bitCount -= len;
+      return symbol[index + (code - first)];
+    }
+
+    index += n;
+    first += n;
+    first <<= 1;
+    code <<= 1;
+  }
+
+  return -2;
+}
+
+void AsyncFTPInflate::_put(uint8_t c)
+{
+  _window[_wpos] = c;
+  _wpos = (_wpos + 1) & (_windowSize - 1);
+  _pending++;
+  _total++;
+
+  uint32_t a = (_adler & 0xFFFF) + c;
+  if (a >= 65521)
+    a -= 65521;
+  uint32_t b = (_adler >> 16) + a;
+  if (b >= 65521)
+    b -= 65521;
+  _adler = (b << 16) | a;
+}
+
+int AsyncFTPInflate::_step(const uint8_t *&in, const uint8_t *end)
+{
+  uint32_t v;
+
+  switch (_state)
+  {
+  case INFLATE_HEADER:
+  {
+    if (!_bits(16, v))
+      return STEP_NEED_INPUT;
+
+    uint8_t cmf = v & 0xFF;
+    uint8_t flg = v >> 8;
+    if ((cmf & 0x0F) != 8 || (cmf >> 4) + 8 > _windowBits ||
+        (flg & 0x20) || ((cmf << 8) | flg) % 31)
+      return STEP_ERROR;
+
+    _state = INFLATE_BLOCK;
+    return STEP_OK;
+  }
+
+  case INFLATE_BLOCK:
+    if (!_bits(3, v))
+      return STEP_NEED_INPUT;
+
+    _final = v & 1;
+    switch (v >> 1)
+    {
+    case 0:
+      _state = INFLATE_STORED_HEADER;
+      break;
+
+    case 1:
+      memset(_lengths, 8, 144);
+      memset(_lengths + 144, 9, 112);
+      memset(_lengths + 256, 7, 24);
+      memset(_lengths + 280, 8, 8);
+      _build(_litCount, _litSymbol, _lengths, 288);
+      memset(_lengths, 5, 30);
+      _build(_distCount, _distSymbol, _lengths, 30);
+      _state = INFLATE_CODES;
+      break;
+
+    case 2:
+      _state = INFLATE_TABLE_HEADER;
+      break;
+
+    default:
+      return STEP_ERROR;
+    }
+    return STEP_OK;
+
+  case INFLATE_STORED_HEADER:
+    _bits(_bitCount & 7, v);
+    if (!_bits(32, v))
+      return STEP_NEED_INPUT;
+    if ((v & 0xFFFF) != (~v >> 16))
+      return STEP_ERROR;
+
+    _storedLeft = v & 0xFFFF;
+    _state = INFLATE_STORED;
+    return STEP_OK;
+
+  case INFLATE_STORED:
+    while (_storedLeft && _pending < _windowSize)
+    {
+      if (_bits(8, v))
+        _put(v);
+      else if (in < end)
+        _put(*in++);
+      else
+        return STEP_NEED_INPUT;
+      _storedLeft--;
+    }
+
+    if (_storedLeft)
+      return STEP_OUTPUT_FULL;
+
+    _state = _final ? INFLATE_TRAILER : INFLATE_BLOCK;
+    return STEP_OK;
+
+  case INFLATE_TABLE_HEADER:
+    if (!_bits(14, v))
+      return STEP_NEED_INPUT;
+
+    _hlit = (v & 0x1F) + 257;
+    _hdist = ((v >> 5) & 0x1F) + 1;
+    _hclen = (v >> 10) + 4;
+    if (_hlit > 286 || _hdist > 30)
+      return STEP_ERROR;
+
+    memset(_lengths, 0, 19);
+    _lengthIndex = 0;
+    _state = INFLATE_CODE_LENGTHS;
+    return STEP_OK;
+
+  case INFLATE_CODE_LENGTHS:
+    if (_lengthIndex < _hclen)
+    {
+      if (!_bits(3, v))
+        return STEP_NEED_INPUT;
+      _lengths[CODE_LENGTH_ORDER[_lengthIndex++]] = v;
+      return STEP_OK;
+    }
+
+    // The code length code lives in the distance table until it is needed.
+    if (!_build(_distCount, _distSymbol, _lengths, 19))
+      return STEP_ERROR;
+
+    _lengthIndex = 0;
+    _state = INFLATE_LENGTHS;
+    return STEP_OK;
+
+  case INFLATE_LENGTHS:
+  {
+    if (_lengthIndex == _hlit + _hdist)
+    {
+      if (!_lengths[256] ||
+          !_build(_litCount, _litSymbol, _lengths, _hlit) ||
+          !_build(_distCount, _distSymbol, _lengths + _hlit, _hdist))
+        return STEP_ERROR;
+
+      _state = INFLATE_CODES;
+      return STEP_OK;
+    }
+
+    int sym = _decode(_distCount, _distSymbol);
+    if (sym == -1)
+      return STEP_NEED_INPUT;
+    if (sym < 0)
+      return STEP_ERROR;
+
+    if (sym < 16)
+    {
+      _lengths[_lengthIndex++] = sym;
+      return STEP_OK;
+    }
+
+    uint8_t len = 0;
+    uint32_t repeat;
+    if (sym == 16)
+    {
+      if (!_lengthIndex)
+        return STEP_ERROR;
+      len = _lengths[_lengthIndex - 1];
+      if (!_bits(2, repeat))
+        return STEP_NEED_INPUT;
+      repeat += 3;
+    }
+    else if (sym == 17)
+    {
+      if (!_bits(3, repeat))
+        return STEP_NEED_INPUT;
+      repeat += 3;
+    }
+    else
+    {
+      if (!_bits(7, repeat))
+        return STEP_NEED_INPUT;
+      repeat += 11;
+    }
+
+    if (_lengthIndex + repeat > _hlit + _hdist)
+      return STEP_ERROR;
+
+    while (repeat--)
+      _lengths[_lengthIndex++] = len;
+    return STEP_OK;
+  }
+
+  case INFLATE_CODES:
+  {
+    if (_pending + 258 > _windowSize)
+      return STEP_OUTPUT_FULL;
+
+    int sym = _decode(_litCount, _litSymbol);
+    if (sym == -1)
+      return STEP_NEED_INPUT;
+    if (sym < 0)
+      return STEP_ERROR;
+
+    if (sym < 256)
+    {
+      _put(sym);
+      return STEP_OK;
+    }
+
+    if (sym == 256)
+    {
+      _state = _final ? INFLATE_TRAILER : INFLATE_BLOCK;
+      return STEP_OK;
+    }
+
+    sym -= 257;
+    if (sym >= 29)
+      return STEP_ERROR;
+
+    uint32_t extra;
+    if (!_bits(LENGTH_EXTRA[sym], extra))
+      return STEP_NEED_INPUT;
+    size_t len = LENGTH_BASE[sym] + extra;
+
+    sym = _decode(_distCount, _distSymbol);
+    if (sym == -1)
+      return STEP_NEED_INPUT;
+    if (sym < 0 || sym >= 30)
+      return STEP_ERROR;
+
+    if (!_bits(DIST_EXTRA[sym], extra))
+      return STEP_NEED_INPUT;
+    size_t dist = DIST_BASE[sym] + extra;
+
+    if (dist > _windowSize || dist > _total)
+      return STEP_ERROR;
+
+    size_t from = (_wpos - dist) & (_windowSize - 1);
+    while (len--)
+    {
+      _put(_window[from]);
+      from = (from + 1) & (_windowSize - 1);
+    }
+    return STEP_OK;
+  }
+
+  case INFLATE_TRAILER:
+  {
+    _bits(_bitCount & 7, v);
+    if (!_bits(32, v))
+      return STEP_NEED_INPUT;
+
+    uint32_t adler = ((v & 0xFF) << 24) | ((v & 0xFF00) << 8) | ((v >> 8) & 0xFF00) | (v >> 24);
+    if (adler != _adler)
+      return STEP_ERROR;
+
+    _state = INFLATE_DONE;
+    return STEP_OK;
+  }
+  }
+
+  return STEP_ERROR;
+}
+
+size_t AsyncFTPInflate::write(const uint8_t *data, size_t len)
+{
+  const uint8_t *in = data;
+  const uint8_t *end = data + len;
+
+  while (_state != INFLATE_DONE && _state != INFLATE_ERROR)
+  {
+    while (_bitCount <= 56 && in < end)
+    {
+      _bitBuf |= (uint64_t)*in++ << _bitCount;
+      _bitCount += 8;
+    }
+
+    uint64_t bitBuf = _bitBuf;
+    uint8_t bitCount = _bitCount;
+
+    int result = _step(in, end);
+    if (result == STEP_OK)
+      continue;
+
+    if (result == STEP_ERROR)
+      _state = INFLATE_ERROR;
+    else if (result == STEP_NEED_INPUT && _state != INFLATE_STORED)
+    {
+      _bitBuf = bitBuf;
+      _bitCount = bitCount;
+    }
+    break;
+  }
+
+  return in - data;
+}
+
+const uint8_t *AsyncFTPInflate::output(size_t &len)
+{
+  len = _pending;
+  if (len > _windowSize - _flushPos)
+    len = _windowSize - _flushPos;
+  return len ? _window + _flushPos : nullptr;
+}
+
+void AsyncFTPInflate::consume(size_t len)
+{
+  _flushPos = (_flushPos + len) & (_windowSize - 1);
+  _pending -= len;
+}
+
+bool AsyncFTPInflate::finished() const
+{
+  return _state == INFLATE_DONE;
+}
+
+bool AsyncFTPInflate::failed() const
+{
+  return _state == INFLATE_ERROR;
+}
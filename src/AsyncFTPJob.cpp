@@ -0,0 +1,11 @@
+#include "ESPAsyncFTPServer.h"
+
+void AsyncFTPJob::detach()
+{
+  _client = nullptr;
+}
+
+AsyncFTPClient *AsyncFTPJob::client() const
+{
+  return _client;
+}
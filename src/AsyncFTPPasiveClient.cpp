@@ -3,10 +3,9 @@
 static const char *MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
                                "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
 
-static String formatDirEntry(const char *name, bool isDir, size_t size, time_t t)
+size_t AsyncFTPPasiveClient::formatDirEntry(char *buf, size_t len, const char *name, bool isDir,
+                                            size_t size, time_t t, const struct tm &now)
 {
-  char line[128];
-
   char date[16];
   if (t == 0)
   {
@@ -17,11 +16,7 @@ static String formatDirEntry(const char *name, bool isDir, size_t size, time_t t
     struct tm tm_info;
     localtime_r(&t, &tm_info);
 
-    time_t now = time(nullptr);
-    struct tm tm_now;
-    localtime_r(&now, &tm_now);
-
-    if (tm_info.tm_year == tm_now.tm_year)
+    if (tm_info.tm_year == now.tm_year)
     {
       snprintf(date, sizeof(date), "%s %2d %02d:%02d",
                MONTHS[tm_info.tm_mon],
@@ -40,16 +35,65 @@ static String formatDirEntry(const char *name, bool isDir, size_t size, time_t t
 
   const char *base = (name[0] == '/') ? name + 1 : name;
 
+  int n;
   if (isDir)
-    snprintf(line, sizeof(line),
-             "drwxr-xr-x 1 user group %8d %s %s\r\n",
-             0, date, base);
+    n = snprintf(buf, len,
+                 "drwxr-xr-x 1 user group %8d %s %s\r\n",
+                 0, date, base);
   else
-    snprintf(line, sizeof(line),
-             "-rw-r--r-- 1 user group %8u %s %s\r\n",
-             (unsigned)size, date, base);
+    n = snprintf(buf, len,
+                 "-rw-r--r-- 1 user group %8u %s %s\r\n",
+                 (unsigned)size, date, base);
+
+  if (n < 0)
+    return 0;
+
+  // Keep the line terminated when an overlong name got truncated.
+  if ((size_t)n >= len)
+  {
+    n = len - 1;
+    buf[n - 2] = '\r';
+    buf[n - 1] = '\n';
+  }
 
-  return line;
+  return n;
+}
+
+size_t AsyncFTPPasiveClient::formatFacts(char *buf, size_t len, const char *name, bool isDir,
+                                         size_t size, time_t t, const char *perm)
+{
+  if (!perm)
+    perm = isDir ? "elcdfmp" : "rwdf";
+
+  int n;
+  if (isDir)
+    n = snprintf(buf, len, "type=dir;perm=%s;", perm);
+  else
+    n = snprintf(buf, len, "type=file;size=%u;perm=%s;", (unsigned)size, perm);
+
+  if (t != 0 && n >= 0 && (size_t)n < len)
+  {
+    struct tm tm_info;
+    gmtime_r(&t, &tm_info);
+    n += snprintf(buf + n, len - n, "modify=%04d%02d%02d%02d%02d%02d;",
+                  tm_info.tm_year + 1900, tm_info.tm_mon + 1, tm_info.tm_mday,
+                  tm_info.tm_hour, tm_info.tm_min, tm_info.tm_sec);
+  }
+
+  if (n >= 0 && (size_t)n < len)
+    n += snprintf(buf + n, len - n, " %s\r\n", name);
+
+  if (n < 0)
+    return 0;
+
+  if ((size_t)n >= len)
+  {
+    n = len - 1;
+    buf[n - 2] = '\r';
+    buf[n - 1] = '\n';
+  }
+
+  return n;
 }
 
 void AsyncFTPPasiveClient::writeDirEntry(File &file)
@@ -74,8 +118,13 @@ void AsyncFTPPasiveClient::writeDirEntry(const String &name, bool isDir, size_t
 
 void AsyncFTPPasiveClient::writeDirEntry(const char *name, bool isDir, size_t size, time_t t)
 {
-  String entry = formatDirEntry(name, isDir, size, t);
-  _client->write(entry.c_str());
+  time_t now = time(nullptr);
+  struct tm tm_now;
+  localtime_r(&now, &tm_now);
+
+  char line[FTP_LIST_LINE_MAX];
+  size_t len = formatDirEntry(line, sizeof(line), name, isDir, size, t, tm_now);
+  _client->write(line, len);
 }
 
 size_t AsyncFTPPasiveClient::write(const char *data, size_t size)
@@ -83,7 +132,54 @@ size_t AsyncFTPPasiveClient::write(const char *data, size_t size)
   return _client->write(data, size);
 }
 
+size_t AsyncFTPPasiveClient::add(const char *data, size_t size, uint8_t flags)
+{
+  return _client->add(data, size, flags);
+}
+
+bool AsyncFTPPasiveClient::send()
+{
+  return _client->send();
+}
+
+size_t AsyncFTPPasiveClient::space()
+{
+  return _client->space();
+}
+
+void AsyncFTPPasiveClient::ackLater()
+{
+  _client->ackLater();
+}
+
+size_t AsyncFTPPasiveClient::ack(size_t len)
+{
+  return _client->ack(len);
+}
+
+AsyncClient *AsyncFTPPasiveClient::client() const
+{
+  return _client;
+}
+
 void AsyncFTPPasiveClient::close()
 {
   _client->close();
 }
+
+void AsyncFTPPasiveClient::detach(bool abort)
+{
+  // The listener is going back to the pool, so the connection has to clean
+  // up after itself once the close completes.
+  _client->onAck(nullptr);
+  _client->onData(nullptr);
+  _client->onDisconnect(
+      [](void *, AsyncClient *c)
+      {
+        delete c;
+      });
+  if (abort)
+    _client->abort();
+  else
+    _client->close();
+}
@@ -1,6 +1,11 @@
 #include "ESPAsyncFTPServer.h"
 
-static String formatBytes(size_t bytes)
+#if defined(ESP32) && FTP_VFS_TRUNCATE
+#include <FSImpl.h>
+#include <unistd.h>
+#endif
+
+static String formatBytes(uint64_t bytes)
 {
   if (bytes < 1024)
     return String(bytes) + "B";
@@ -11,62 +16,817 @@ static String formatBytes(size_t bytes)
   return String(bytes / (1024.0 * 1024.0 * 1024.0)) + "GB";
 }
 
-static String formatUsage(size_t used, size_t total)
+static String formatUsage(uint64_t used, uint64_t total)
 {
   return String(" (") + formatBytes(total - used) + " of " + formatBytes(total) + ")";
 }
 
-void AsyncFTPPasiveServer::_sendFile()
+#if defined(ESP32) && FTP_VFS_TRUNCATE
+// FS keeps the VFS mount point that POSIX calls need behind a protected member.
+struct FSMountpoint : public fs::FS
+{
+  static const char *of(fs::FS &fs)
+  {
+    fs::FSImplPtr impl = fs.*(&FSMountpoint::_impl);
+    return impl ? impl->mountpoint() : nullptr;
+  }
+};
+#endif
+
+// Cuts a file back to size and closes it; false where that failed.
+static bool truncateFile(FS &fs, File &file, size_t size)
+{
+#if defined(ESP8266)
+  bool truncated = file.truncate(size);
+  file.close();
+  return truncated;
+#else
+  String path = file.path();
+  file.close();
+
+#if defined(ESP32) && FTP_VFS_TRUNCATE
+  const char *mountpoint = FSMountpoint::of(fs);
+  if (mountpoint && truncate((String(mountpoint) + path).c_str(), size) == 0)
+    return true;
+#endif
+
+  // Without a public truncate the part that stays is copied to a new file,
+  // which then takes the original's place.
+  String tempPath = path + FTP_STOR_TEMP_SUFFIX;
+  File in = fs.open(path, FILE_READ);
+  File out = fs.open(tempPath, FILE_WRITE);
+  bool copied = in && out;
+  uint8_t buf[512];
+  for (size_t left = size; copied && left;)
+  {
+    size_t chunk = left < sizeof(buf) ? left : sizeof(buf);
+    copied = in.read(buf, chunk) == chunk && out.write(buf, chunk) == chunk;
+    left -= chunk;
+  }
+  in.close();
+  out.close();
+
+  if (copied && fs.rename(tempPath, path))
+    return true;
+  fs.remove(tempPath);
+  return false;
+#endif
+}
+
+void AsyncFTPPasiveServer::_resetSendRing()
+{
+  _sendDepth = _ftpServer->transferMode() == FTP_TRANSFER_PIPELINED ? FTP_SEND_BUFFER_COUNT : 1;
+  _sendHead = 0;
+  _sendFilled = 0;
+  _sendQueued = 0;
+  _sendBufOffset = 0;
+  _sendBufAcked = 0;
+  _sendEof = false;
+}
+
+bool AsyncFTPPasiveServer::_sendDone() const
+{
+  return _sendEof && (!_deflate || _deflate->finished());
+}
+
+size_t AsyncFTPPasiveServer::_readSource(uint8_t *buf, size_t len)
 {
-  if (_sendBufOffset == _sendBufSize)
+  if (_command == FTP_COMMAND_RETR && _sidecar.reading())
   {
-    if (!_file || !_file.available())
+    size_t size = _sidecar.read(buf, len);
+    if (!size)
+      _sendEof = true;
+    return size;
+  }
+
+  if (_command == FTP_COMMAND_RETR && _producer)
+  {
+    size_t size = len < _sendRemaining ? len : _sendRemaining;
+    size = size ? _producer(_producerArg, buf, size, _producerPos) : 0;
+    if (!size)
+      _sendEof = true;
+
+    _producerPos += size;
+    _sendRemaining -= size;
+    return size;
+  }
+
+  if (_command == FTP_COMMAND_RETR && _hotFile)
+  {
+    size_t size = _hotFile->size - _hotPos;
+    if (size > len)
+      size = len;
+    if (size > _sendRemaining)
+      size = _sendRemaining;
+    if (!size)
+      _sendEof = true;
+
+    memcpy(buf, _hotFile->data + _hotPos, size);
+    _hotPos += size;
+    _sendRemaining -= size;
+    _ftpServer->recordHotBytes(size);
+    return size;
+  }
+
+  if (_command == FTP_COMMAND_RETR)
+  {
+    size_t size = len < _sendRemaining ? len : _sendRemaining;
+    size = size && _file ? _file.read(buf, size) : 0;
+    if (!size)
+      _sendEof = true;
+
+    _sendRemaining -= size;
+
+    if (_hotCapture)
     {
-      _client->close();
-      return;
+      if (_hotCapturePos + size > _hotCapture->size)
+        _hotCapture.reset();
+      else
+      {
+        memcpy(_hotCapture->data + _hotCapturePos, buf, size);
+        _hotCapturePos += size;
+      }
     }
 
-    _sendBufSize = _file.read(_sendBuf, sizeof(_sendBuf));
+    if (_hotCapture && _sendEof)
+    {
+      if (_hotCapturePos == _hotCapture->size)
+        _ftpServer->storeHotFile(_hotKey, _hotCapture, _hotGeneration);
+      _hotCapture.reset();
+    }
+
+    return size;
+  }
+
+  return _readList(buf, len);
+}
+
+size_t AsyncFTPPasiveServer::_readCompressed(uint8_t *buf, size_t len)
+{
+  size_t size = 0;
+
+  while (len - size >= 8 && !_deflate->finished())
+  {
+    size_t accepted = 0;
+    if (!_sendEof)
+    {
+      size_t space;
+      uint8_t *in = _deflate->inputBuffer(space);
+      accepted = space ? _readSource(in, space) : 0;
+      _deflate->commitInput(accepted);
+      _sidecar.update(in, accepted);
+    }
+
+    size_t produced = _deflate->read(buf + size, len - size, _sendEof);
+    _sidecar.write(buf + size, produced);
+    size += produced;
+
+    if (_deflate->finished())
+      _sidecar.commit();
+
+    if (!produced && !accepted)
+      break;
+  }
+
+  return size;
+}
+
+void AsyncFTPPasiveServer::_fillSendRing()
+{
+  while (!_sendDone() && _sendFilled < _sendDepth)
+  {
+    uint8_t slot = (_sendHead + _sendFilled) % FTP_SEND_BUFFER_COUNT;
+    size_t size = _deflate ? _readCompressed(_sendBuf[slot], FTP_SEND_BUFFER_SIZE)
+                           : _readSource(_sendBuf[slot], FTP_SEND_BUFFER_SIZE);
+    if (!size)
+      break;
+
+    _sendBufSize[slot] = size;
+    _sendFilled++;
+  }
+}
+
+void AsyncFTPPasiveServer::_ackSendRing(size_t len)
+{
+  // A slot that add() only partly queued is not counted in _sendQueued yet,
+  // but its leading bytes can already be acknowledged. It only completes
+  // once all of it has been handed over, so the ring is walked by filled slots.
+  while (len && _sendFilled)
+  {
+    size_t pending = _sendBufSize[_sendHead] - _sendBufAcked;
+    size_t acked = len < pending ? len : pending;
+
+    _sendBufAcked += acked;
+    len -= acked;
+
+    if (_sendBufAcked < _sendBufSize[_sendHead])
+      break;
+
+    _sendHead = (_sendHead + 1) % FTP_SEND_BUFFER_COUNT;
+    _sendFilled--;
+    _sendQueued--;
+    _sendBufAcked = 0;
+  }
+}
+
+void AsyncFTPPasiveServer::_sendData()
+{
+  _fillSendRing();
+
+  bool queued = false;
+  while (_sendQueued < _sendFilled)
+  {
+    uint8_t slot = (_sendHead + _sendQueued) % FTP_SEND_BUFFER_COUNT;
+    size_t added = _client->add((char *)_sendBuf[slot] + _sendBufOffset,
+                                _sendBufSize[slot] - _sendBufOffset, 0);
+    if (!added)
+      break;
+
+    queued = true;
+    _sendBufOffset += added;
+    if (_sendBufOffset < _sendBufSize[slot])
+      break;
+
+    _sendQueued++;
     _sendBufOffset = 0;
   }
 
-  size_t sent = _client->write((char *)_sendBuf + _sendBufOffset, _sendBufSize - _sendBufOffset);
-  _sendBufOffset += sent;
+  if (queued)
+    _client->send();
+  else if (_sendDone() && !_sendFilled)
+    _client->close();
+
+  // Produce the next chunk while the queued ones are in flight.
+  _fillSendRing();
 }
 
-void AsyncFTPPasiveServer::_sendList()
+void AsyncFTPPasiveServer::_resetWriteBuf()
 {
-  if (!_file)
+  _writeBufSize = 0;
+  _storeBytes = 0;
+  _storeWritten = 0;
+  _storeWrites = 0;
+
+  if (_ftpServer->flushPolicy() == FTP_FLUSH_SEGMENT)
+  {
+    _writeBufLimit = 0;
+    return;
+  }
+
+  // Keep flushes on block boundaries even when the file does not start at one.
+  size_t block = _ftpServer->flushBlockSize();
+  _writeBufLimit = block - (_file ? _file.position() % block : 0);
+}
+
+bool AsyncFTPPasiveServer::_flushWriteBuf()
+{
+  if (!_writeBufSize)
+    return true;
+
+  bool success = _writeOut(_writeBuf, _writeBufSize);
+  _writeBufSize = 0;
+  _writeBufLimit = _ftpServer->flushBlockSize();
+  return success;
+}
+
+bool AsyncFTPPasiveServer::_writeOut(const uint8_t *data, size_t len)
+{
+  _storeWrites++;
+
+  if (_sink ? _sink(_sinkArg, FTP_SINK_DATA, data, len) : _file.write(data, len) == len)
   {
-#if FTP_USE_LITTLEFS
-    if (_ftpServer->littleFSAvailable())
+    _storeWritten += len;
+    return true;
+  }
+
+  _transferError = _sink ? "451 Upload rejected by target." : "452 Insufficient storage space.";
+  return false;
+}
+
+void AsyncFTPPasiveServer::_releaseReceive()
+{
+  if (_rxHeld && _client)
+    _client->ack(_rxHeld);
+  _rxHeld = 0;
+}
+
+bool AsyncFTPPasiveServer::_storeData(const uint8_t *data, size_t len)
+{
+  _storeBytes += len;
+  if (_storeDigest)
+    _storeDigest->update(data, len);
+
+  if (len > _remainingSpace || (_remainingSpace -= len) < 8192)
+  {
+    _transferError = "452 Insufficient storage space.";
+    return false;
+  }
+
+  // Nothing is written while the upload matches the existing file.
+  if (_comparing && !_original)
+  {
+    size_t matched = 0;
+    while (matched < len)
     {
-      String usage = formatUsage(LittleFS.usedBytes(), LittleFS.totalBytes());
-      _client->writeDirEntry(FTP_LITTLEFS_ROOT_PATH + usage);
+      size_t chunk = len - matched < sizeof(_writeBuf) ? len - matched : sizeof(_writeBuf);
+      size_t read = _file.read(_writeBuf, chunk);
+      size_t same = 0;
+      while (same < read && _writeBuf[same] == data[matched + same])
+        same++;
+
+      matched += same;
+      if (same < chunk)
+        break;
     }
-#endif
 
-#if FTP_USE_SDFS
-    if (_ftpServer->sdFSAvailable())
+    _compared += matched;
+    if (matched == len)
+      return true;
+    if (!_beginRewrite(false))
+      return false;
+
+    data += matched;
+    len -= matched;
+  }
+
+  if (_prefixLeft)
+  {
+    if (_held.size() + len <= FTP_STOR_HOLD_SIZE)
     {
-      String usage = formatUsage(SD.usedBytes(), SD.totalBytes());
-      _client->writeDirEntry(FTP_LITTLEFS_ROOT_PATH + usage);
+      _held.insert(_held.end(), data, data + len);
+      return true;
     }
-#endif
 
-    _client->close();
+    // More arrived than the held window should allow; the prefix is
+    // finished here instead, which also stores what was held.
+    while (copyPrefix())
+      ;
+    if (_transferError)
+      return false;
+  }
+
+  return _bufferData(data, len);
+}
+
+bool AsyncFTPPasiveServer::_bufferData(const uint8_t *data, size_t len)
+{
+  if (!_writeBufLimit)
+    return _writeOut(data, len);
+
+  while (len)
+  {
+    size_t chunk = _writeBufLimit - _writeBufSize;
+    if (chunk > len)
+      chunk = len;
+
+    memcpy(_writeBuf + _writeBufSize, data, chunk);
+    _writeBufSize += chunk;
+    data += chunk;
+    len -= chunk;
+
+    if (_writeBufSize == _writeBufLimit && !_flushWriteBuf())
+      return false;
+  }
+
+  return true;
+}
+
+bool AsyncFTPPasiveServer::_storeCompressed(const uint8_t *data, size_t len)
+{
+  while (true)
+  {
+    size_t consumed = _inflate->write(data, len);
+    data += consumed;
+    len -= consumed;
+
+    size_t size;
+    const uint8_t *out;
+    bool drained = false;
+    while ((out = _inflate->output(size)))
+    {
+      if (!_storeData(out, size))
+        return false;
+      _inflate->consume(size);
+      drained = true;
+    }
+
+    if (_inflate->failed())
+    {
+      _transferError = "451 Invalid compressed data.";
+      return false;
+    }
+
+    if (!len || (!consumed && !drained))
+      return true;
+  }
+}
+
+bool AsyncFTPPasiveServer::_beginRewrite(bool wait)
+{
+  String tempPath = String(_file.path()) + FTP_STOR_TEMP_SUFFIX;
+  File temp = _fs->open(tempPath, FILE_WRITE);
+  if (!temp || !_file.seek(0))
+  {
+    temp.close();
+    _fs->remove(tempPath);
+    _transferError = "452 Insufficient storage space.";
+    return false;
+  }
+
+  _original = _file;
+  _file = temp;
+  _prefixLeft = _compared;
+  if (!_prefixLeft)
+  {
+    _endPrefix();
+    return true;
+  }
+
+  // A late difference in a large file would otherwise stall the TCP task
+  // for as long as the copy takes. Without a free job slot it still does.
+  if (!wait)
+  {
+    _rewriteJob = new AsyncFTPRewriteJob(_ftpServer, this);
+    if (_rewriteJob && _ftpServer->startJob(_rewriteJob))
+      return !_transferError;
+
+    delete _rewriteJob;
+    _rewriteJob = nullptr;
+  }
+
+  while (copyPrefix())
+    ;
+  return !_transferError;
+}
+
+bool AsyncFTPPasiveServer::copyPrefix()
+{
+  if (!_prefixLeft)
+    return false;
+
+  // Nothing sits in the write-behind block until the prefix is in place.
+  size_t chunk = _prefixLeft < sizeof(_writeBuf) ? _prefixLeft : sizeof(_writeBuf);
+  _storeWrites++;
+  if (_original.read(_writeBuf, chunk) != chunk || _file.write(_writeBuf, chunk) != chunk)
+  {
+    _transferError = "452 Insufficient storage space.";
+    _failPrefix();
+    return false;
+  }
+
+  _storeWritten += chunk;
+  _prefixLeft -= chunk;
+  if (_prefixLeft)
+    return true;
+
+  _endPrefix();
+  return false;
+}
+
+void AsyncFTPPasiveServer::_endPrefix()
+{
+  _endRewriteJob();
+
+  if (_writeBufLimit)
+  {
+    size_t block = _ftpServer->flushBlockSize();
+    _writeBufLimit = block - _compared % block;
+  }
+
+  std::vector<uint8_t> held;
+  held.swap(_held);
+  if (!held.empty() && !_bufferData(held.data(), held.size()))
+  {
+    _failPrefix();
+    return;
+  }
+
+  if (_finishPending)
+    _finishTransfer();
+  else if (_rxThrottled)
+  {
+    _rxThrottled = false;
+    _releaseReceive();
+  }
+}
+
+void AsyncFTPPasiveServer::_failPrefix()
+{
+  _abortStore();
+  if (_finishPending)
+    _finishTransfer();
+  else
+    _closing = true;
+}
+
+void AsyncFTPPasiveServer::_endRewriteJob()
+{
+  // The job is deleted by the server once its next step finds it cancelled.
+  if (_rewriteJob)
+    _rewriteJob->cancel();
+  _rewriteJob = nullptr;
+}
+
+bool AsyncFTPPasiveServer::_finishCompare()
+{
+  if (!_original)
+  {
+    if (_compared == _file.size())
+    {
+      _comparing = false;
+      return true;
+    }
+
+    // A shorter upload that matched so far is the original cut short. Only
+    // if truncating fails is the prefix copied through a rewrite, right here.
+    String path = _file.path();
+    if (truncateFile(*_fs, _file, _compared))
+    {
+      _comparing = false;
+      if (AsyncFTPSidecar::invalidate(*_fs, path))
+        _ftpServer->adjustUsedSpace(_fs, 0);
+      _file = _fs->open(path, FILE_READ);
+      return true;
+    }
+
+    _file = _fs->open(path, FILE_READ);
+    if (!_file || !_beginRewrite(true))
+    {
+      _transferError = "451 Local error in processing.";
+      _abortStore();
+      return false;
+    }
+  }
+
+  String tempPath = _file.path();
+  String path = _original.path();
+  _file.close();
+  _original.close();
+  _comparing = false;
+
+  // Renaming over the original replaces it in one step where the filesystem
+  // allows that. Elsewhere the original is moved aside first and put back if
+  // the new version cannot take its place.
+  bool replaced = _fs->rename(tempPath, path);
+  if (!replaced)
+  {
+    String backupPath = path + FTP_STOR_BACKUP_SUFFIX;
+    if (_fs->rename(path, backupPath))
+    {
+      replaced = _fs->rename(tempPath, path);
+      if (replaced)
+        _fs->remove(backupPath);
+      else
+        _fs->rename(backupPath, path);
+    }
+  }
+
+  if (!replaced)
+  {
+    _fs->remove(tempPath);
+    _transferError = "451 Local error in processing.";
+    return false;
+  }
+
+  if (AsyncFTPSidecar::invalidate(*_fs, path))
+    _ftpServer->adjustUsedSpace(_fs, 0);
+
+  // Reopened so that the size and path of the new version can be reported.
+  _file = _fs->open(path, FILE_READ);
+  return true;
+}
+
+void AsyncFTPPasiveServer::_abortStore()
+{
+  if (!_sink && !_file)
+  {
+    _writeBufSize = 0;
+    return;
+  }
+
+  if (_sink)
+  {
+    _sink(_sinkArg, FTP_SINK_ABORT, nullptr, 0);
+    _sink = nullptr;
+    _writeBufSize = 0;
+    return;
+  }
+
+  // The original stays as it was; only a partial new version is dropped.
+  if (_comparing)
+  {
+    _endRewriteJob();
+    _prefixLeft = 0;
+    std::vector<uint8_t>().swap(_held);
+    if (_original)
+    {
+      String tempPath = _file.path();
+      _file.close();
+      _fs->remove(tempPath);
+      _original.close();
+    }
+    _file.close();
+    _comparing = false;
+    _writeBufSize = 0;
+    return;
+  }
+
+  _writeBufSize = 0;
+
+  // A resumed or appended upload only loses what this transfer added. Where
+  // the filesystem cannot truncate, those bytes stay and are accounted for.
+  if (_storeStartSize)
+  {
+    size_t size = _file.size();
+    if (size > _storeStartSize && !truncateFile(*_fs, _file, _storeStartSize))
+      _ftpServer->adjustUsedSpace(_fs, (int64_t)size - (int64_t)_storeStartSize);
+    _file.close();
     return;
   }
 
+  String path = _file.path();
+  _file.close();
+  _fs->remove(path);
+}
+
+void AsyncFTPPasiveServer::_endDigest()
+{
+  delete _storeDigest;
+  _storeDigest = nullptr;
+  _digestEnabled = false;
+}
+
+void AsyncFTPPasiveServer::_resetList()
+{
+  _endList();
+  _listIndex = 0;
+  _listVirtual = false;
+  _listVirtualIndex = 0;
+
+  time_t now = time(nullptr);
+  localtime_r(&now, &_listNow);
+
+  _listKey = _file && _fs ? AsyncFTPServer::pathKey(_ftpServer->virtualPath(_fs, _file.path()))
+                          : String(FTP_ROOT_PATH);
+
+  // The root overview carries live usage figures and is always rendered.
+  if (_file && _fs && _ftpServer->listCacheBudget())
+  {
+    _listReplay = _ftpServer->findListing(_listKey, _command);
+    _listReplayPos = 0;
+    _listCapturing = !_listReplay;
+    _listGeneration = _ftpServer->cacheGeneration();
+  }
+}
+
+void AsyncFTPPasiveServer::_endHot()
+{
+  _hotFile.reset();
+  _hotCapture.reset();
+}
+
+void AsyncFTPPasiveServer::_endList()
+{
+  _listReplay.reset();
+  _listCapturing = false;
+  std::vector<uint8_t>().swap(_listCapture);
+}
+
+size_t AsyncFTPPasiveServer::_readList(uint8_t *buf, size_t len)
+{
+  if (_listReplay)
+  {
+    size_t size = _listReplay->size() - _listReplayPos;
+    if (size > len)
+      size = len;
+
+    memcpy(buf, _listReplay->data() + _listReplayPos, size);
+    _listReplayPos += size;
+    if (_listReplayPos == _listReplay->size())
+      _sendEof = true;
+    return size;
+  }
+
+  size_t size = 0;
+  while (!_sendEof && len - size >= FTP_LIST_LINE_MAX)
+  {
+    int rendered = _renderListEntry((char *)buf + size, len - size);
+    if (rendered < 0)
+      _sendEof = true;
+    else
+      size += rendered;
+  }
+
+  if (_listCapturing)
+  {
+    if (_listCapture.size() + size > _ftpServer->listCacheBudget())
+      _endList();
+    else
+      _listCapture.insert(_listCapture.end(), buf, buf + size);
+  }
+
+  if (_listCapturing && _sendEof)
+  {
+    _ftpServer->storeListing(_listKey, _command, std::move(_listCapture), _listGeneration);
+    _endList();
+  }
+
+  return size;
+}
+
+int AsyncFTPPasiveServer::_renderVirtualEntry(char *buf, size_t len)
+{
+  const FTPVirtualFile *file = _ftpServer->virtualFileAt(_listVirtualIndex++);
+  if (!file)
+    return -1;
+
+  // Only files directly inside the listed directory are shown.
+  const String &path = file->path;
+  int slash = path.lastIndexOf('/');
+  size_t parentLen = slash > 0 ? slash : 1;
+  if (parentLen != _listKey.length() || strncmp(path.c_str(), _listKey.c_str(), parentLen))
+    return 0;
+
+  const char *name = path.c_str() + slash + 1;
+  if (_command == FTP_COMMAND_MLSD)
+    return AsyncFTPPasiveClient::formatFacts(buf, len, name, false, file->sizeHint, 0,
+                                             !file->sink ? "r" : file->producer ? "rw" : "w");
+  return AsyncFTPPasiveClient::formatDirEntry(buf, len, name, false, file->sizeHint, 0, _listNow);
+}
+
+int AsyncFTPPasiveServer::_renderListEntry(char *buf, size_t len)
+{
+  // Virtual files follow the directory's own entries.
+  if (_listVirtual)
+    return _renderVirtualEntry(buf, len);
+
+  if (!_file)
+  {
+    String name;
+    size_t size = 0;
+
+    const FTPMount *mount = _ftpServer->mountAt(_listIndex++);
+    if (!mount)
+    {
+      _listVirtual = true;
+      return 0;
+    }
+
+    // The overview only lists top-level mounts; nested ones are reached by path.
+    const char *prefix = mount->prefix.c_str();
+    if (strchr(prefix + 1, '/'))
+      return 0;
+
+    if (_command == FTP_COMMAND_MLSD)
+      size = AsyncFTPPasiveClient::formatFacts(buf, len, prefix + 1, true, 0, 0, "elcm");
+    else if (mount->sized)
+      name = prefix + formatUsage(mount->used, mount->total);
+    else
+      name = prefix;
+
+    if (!name.isEmpty())
+      size = AsyncFTPPasiveClient::formatDirEntry(buf, len, name.c_str(), true, 0, 0, _listNow);
+    return size;
+  }
+
   File f = _file.openNextFile();
   if (!f)
   {
-    _client->close();
-    return;
+    _listVirtual = true;
+    return 0;
   }
 
-  _client->writeDirEntry(f);
+  size_t size;
+  if (_command == FTP_COMMAND_MLSD)
+  {
+    const char *name = f.name();
+    if (name[0] == '/')
+      name++;
+    size = AsyncFTPPasiveClient::formatFacts(buf, len, name, f.isDirectory(),
+                                             f.size(), f.getLastWrite());
+  }
+  else
+    size = AsyncFTPPasiveClient::formatDirEntry(buf, len, f.name(), f.isDirectory(),
+                                                f.size(), f.getLastWrite(), _listNow);
   f.close();
+  return size;
+}
+
+void AsyncFTPPasiveServer::_endCodec()
+{
+  delete _deflate;
+  delete _inflate;
+  _deflate = nullptr;
+  _inflate = nullptr;
+  _sidecar.end();
+
+  // A sidecar started by this transfer has now been committed or removed.
+  if (_sidecarCreated)
+  {
+    _ftpServer->invalidatePath(_fs, _file.path());
+    _ftpServer->adjustUsedSpace(_fs, 0);
+    _sidecarCreated = false;
+  }
 }
 
 void AsyncFTPPasiveServer::_tryStartTransfer()
@@ -74,15 +834,20 @@ void AsyncFTPPasiveServer::_tryStartTransfer()
   if (!_client || !_command)
     return;
 
-  _controlClient->write("150 Opening data connection.");
+  _controlClient->reply("150 Opening data connection.\r\n");
+
+  if (_transferError)
+  {
+    _client->close();
+    return;
+  }
 
   switch (_command)
   {
   case FTP_COMMAND_RETR:
-    _sendFile();
-    break;
   case FTP_COMMAND_LIST:
-    _sendList();
+  case FTP_COMMAND_MLSD:
+    _sendData();
     break;
   }
 }
@@ -92,10 +857,10 @@ void AsyncFTPPasiveServer::_onClientAck(size_t len, uint32_t time)
   switch (_command)
   {
   case FTP_COMMAND_RETR:
-    _sendFile();
-    break;
   case FTP_COMMAND_LIST:
-    _sendList();
+  case FTP_COMMAND_MLSD:
+    _ackSendRing(len);
+    _sendData();
     break;
   }
 }
@@ -106,40 +871,172 @@ void AsyncFTPPasiveServer::_onClientData(void *data, size_t len)
   {
   case FTP_COMMAND_STOR:
   {
-    if (!_file || !_fs)
+    if (!_sink && (!_file || !_fs))
       return;
 
-    _remainingSpace -= len;
-    if (_remainingSpace < 8192)
+    // Hold the segment back from the receive window until the write path
+    // has caught up, so a stalled flash cannot make lwIP queue more pbufs.
+    _client->ackLater();
+    _rxHeld += len;
+    _rxStalled = false;
+
+    bool stored = _inflate ? _storeCompressed((uint8_t *)data, len)
+                           : _storeData((uint8_t *)data, len);
+    if (!stored)
     {
-      const char *path = _file.path();
-      _file.close();
-      _fs->remove(path);
-      _storeSuccess = false;
-      _client->close();
+      _abortStore();
+      _closing = true;
       return;
     }
 
-    _file.write((uint8_t *)data, len);
+    // Uncommitted bytes only drop once a block has reached the file, so a
+    // throttled session stays closed until the flush has gone through.
+    size_t high = _controlClient->receiveHighWatermark();
+    if (_prefixLeft || (high && _writeBufSize >= high))
+      _rxThrottled = true;
+    else if (_writeBufSize <= _controlClient->receiveLowWatermark())
+      _rxThrottled = false;
+
+    if (!_rxThrottled)
+      _releaseReceive();
   }
   break;
   }
 }
 
-void AsyncFTPPasiveServer::_onClientDisconnect()
+void AsyncFTPPasiveServer::_onClientPoll()
 {
-  if (_command != FTP_COMMAND_NONE)
+  if (_closing)
   {
-    if (_file)
-      _file.close();
-    if (_command == FTP_COMMAND_STOR && !_storeSuccess)
-      _controlClient->write("452 Insufficient storage space.");
-    else
-      _controlClient->write("226 Transfer complete.");
+    _client->close();
+    return;
+  }
+
+  // The rewrite job reopens the window once the prefix is in place.
+  if (_prefixLeft)
+    return;
+
+  if (_command != FTP_COMMAND_STOR || !_rxThrottled || !_rxHeld)
+    return;
+
+  // A held window can be smaller than the rest of the block, and then no
+  // segment ever arrives to fill it. After a full poll interval without one
+  // the partial block is written out so the window can reopen.
+  if (!_rxStalled)
+  {
+    _rxStalled = true;
+    return;
+  }
+
+  if (!_flushWriteBuf())
+  {
+    _abortStore();
+    _client->close();
+    return;
   }
 
+  if (_writeBufLimit && _file)
+  {
+    size_t block = _ftpServer->flushBlockSize();
+    _writeBufLimit = block - _file.position() % block;
+  }
+
+  _rxThrottled = false;
+  _rxStalled = false;
+  _releaseReceive();
+}
+
+void AsyncFTPPasiveServer::_onClientDisconnect(AsyncClient *c)
+{
   delete _client;
   _client = nullptr;
+  delete c;
+
+  // What the client sent is stored once the prefix is, by the rewrite job.
+  if (_prefixLeft)
+  {
+    _finishPending = true;
+    return;
+  }
+
+  _finishTransfer();
+}
+
+void AsyncFTPPasiveServer::_finishTransfer()
+{
+  _finishPending = false;
+  bool report = _command != FTP_COMMAND_NONE && _controlClient;
+  String digest;
+  String digestPath;
+
+  if (report && _command == FTP_COMMAND_STOR)
+  {
+    if ((_file || _sink) && !_transferError && _inflate && !_inflate->finished())
+    {
+      _transferError = "451 Invalid compressed data.";
+      _abortStore();
+    }
+    if ((_file || _sink) && !_transferError && !_flushWriteBuf())
+      _abortStore();
+
+    if (_storeDigest && (_file || _sink) && !_transferError)
+    {
+      digest = _storeDigest->finish();
+      if (!_expectedDigest.isEmpty() && !digest.equalsIgnoreCase(_expectedDigest))
+      {
+        _transferError = "451 Checksum mismatch, upload discarded.";
+        _abortStore();
+      }
+    }
+    // Only replaces the original once the upload is known to be good.
+    if (_comparing && _file && !_transferError)
+      _finishCompare();
+    if (_file && _digestWhole)
+      digestPath = _ftpServer->virtualPath(_fs, _file.path());
+    if (_sink && !_transferError && !_sink(_sinkArg, FTP_SINK_END, nullptr, 0))
+    {
+      _transferError = "451 Upload rejected by target.";
+      _sink = nullptr;
+    }
+    if (_file)
+      _ftpServer->adjustUsedSpace(_fs, (int64_t)_file.size() - (int64_t)_storeStartSize);
+    _ftpServer->recordUpload(_storeBytes, _storeWrites, _storeWritten);
+    _controlClient->recordUpload(_storeBytes, _storeWritten);
+    // An aborted upload has already closed and removed its file.
+    if (_fs)
+      _ftpServer->invalidatePath(_fs, _file ? String(_file.path()) : String());
+    if (!_file || _transferError)
+      digestPath = String();
+  }
+
+  // A sink that has not seen END was cut off.
+  if (_sink && (!report || _transferError))
+    _abortStore();
+  _sink = nullptr;
+  if (_comparing)
+    _abortStore();
+
+  _endDigest();
+  _endCodec();
+  _endList();
+  _endHot();
+  _producer = nullptr;
+  if (_file)
+    _file.close();
+
+  // Stored once the file is closed, so the sidecar records its final size.
+  if (!digest.isEmpty() && !digestPath.isEmpty())
+    _ftpServer->storeDigest(digestPath, _digestAlgorithm, digest, _ftpServer->cacheGeneration(), true);
+
+  if (report)
+  {
+    if (_transferError)
+      _controlClient->write(_transferError);
+    else
+      _controlClient->reply("226 Transfer complete.\r\n");
+  }
+
+  _command = FTP_COMMAND_NONE;
 }
 
 void AsyncFTPPasiveServer::_onClient(AsyncClient *c)
@@ -147,7 +1044,21 @@ void AsyncFTPPasiveServer::_onClient(AsyncClient *c)
   if (!c)
     return;
 
+  // Idle pooled listeners and busy channels take no further connections,
+  // nor does one whose last upload is still being rewritten.
+  if (!_controlClient || _client || _finishPending)
+  {
+    c->onDisconnect(
+        [](void *, AsyncClient *c)
+        {
+          delete c;
+        });
+    c->close();
+    return;
+  }
+
   _client = new AsyncFTPPasiveClient(c);
+  _closing = false;
 
   if (!_client)
   {
@@ -158,52 +1069,168 @@ void AsyncFTPPasiveServer::_onClient(AsyncClient *c)
   c->onAck(
       [](void *s, AsyncClient *, size_t len, uint32_t time)
       {
-        static_cast<AsyncFTPPasiveServer *>(s)->_onClientAck(len, time);
+        AsyncFTPPasiveServer *server = static_cast<AsyncFTPPasiveServer *>(s);
+        AsyncFTPLock lock(server->_ftpServer);
+        server->_onClientAck(len, time);
       },
       this);
 
   c->onData(
       [](void *s, AsyncClient *, void *data, size_t len)
       {
-        static_cast<AsyncFTPPasiveServer *>(s)->_onClientData(data, len);
+        AsyncFTPPasiveServer *server = static_cast<AsyncFTPPasiveServer *>(s);
+        AsyncFTPLock lock(server->_ftpServer);
+        server->_onClientData(data, len);
       },
       this);
 
-  c->onDisconnect(
+  c->onPoll(
       [](void *s, AsyncClient *)
       {
-        static_cast<AsyncFTPPasiveServer *>(s)->_onClientDisconnect();
+        AsyncFTPPasiveServer *server = static_cast<AsyncFTPPasiveServer *>(s);
+        AsyncFTPLock lock(server->_ftpServer);
+        server->_onClientPoll();
+      },
+      this);
+
+  c->onDisconnect(
+      [](void *s, AsyncClient *c)
+      {
+        AsyncFTPPasiveServer *server = static_cast<AsyncFTPPasiveServer *>(s);
+        AsyncFTPLock lock(server->_ftpServer);
+        server->_onClientDisconnect(c);
       },
       this);
 
   _tryStartTransfer();
 }
 
-AsyncFTPPasiveServer::AsyncFTPPasiveServer(AsyncFTPServer *s, AsyncFTPClient *c, uint16_t port)
-    : _ftpServer(s), _controlClient(c), _server(port)
+AsyncFTPPasiveServer::AsyncFTPPasiveServer(AsyncFTPServer *s, uint16_t port)
+    : _ftpServer(s), _port(port), _server(port)
 {
   _server.onClient(
       [](void *s, AsyncClient *c)
       {
         if (!c)
           return;
-        static_cast<AsyncFTPPasiveServer *>(s)->_onClient(c);
+        AsyncFTPPasiveServer *server = static_cast<AsyncFTPPasiveServer *>(s);
+        AsyncFTPLock lock(server->_ftpServer);
+        server->_onClient(c);
       },
       this);
 
   _server.begin();
+}
+
+AsyncFTPPasiveServer::~AsyncFTPPasiveServer()
+{
+  end();
+}
+
+uint16_t AsyncFTPPasiveServer::port() const
+{
+  return _port;
+}
+
+bool AsyncFTPPasiveServer::listening()
+{
+  return _server.status() != 0;
+}
+
+void AsyncFTPPasiveServer::attach(AsyncFTPClient *c)
+{
+  _controlClient = c;
+  _command = FTP_COMMAND_NONE;
 
-  char response[64];
   IPAddress ip = _controlClient->localIP();
-  snprintf(response, sizeof(response),
-           "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).",
-           ip[0], ip[1], ip[2], ip[3],
-           port >> 8, port & 0xFF);
+  _controlClient->writef("227 Entering Passive Mode (%d,%d,%d,%d,%d,%d).",
+                         ip[0], ip[1], ip[2], ip[3],
+                         _port >> 8, _port & 0xFF);
+}
 
-  _controlClient->write(response);
+void AsyncFTPPasiveServer::detach()
+{
+  // Queued data is added without a copy, so lwIP would keep retransmitting
+  // from send slots that the next transfer refills. Only a reset stops that.
+  if (_client)
+  {
+    _client->detach(_sendQueued || _sendBufOffset);
+    delete _client;
+    _client = nullptr;
+  }
+
+  // Bytes still held in the write-behind block were received and belong in
+  // the file, even though the transfer itself was cut off.
+  if (_command == FTP_COMMAND_STOR && _file && !_sink && !_comparing && !_transferError)
+  {
+    if (_flushWriteBuf())
+    {
+      _ftpServer->adjustUsedSpace(_fs, (int64_t)_file.size() - (int64_t)_storeStartSize);
+      _ftpServer->invalidatePath(_fs, _file.path());
+    }
+    else
+    {
+      _abortStore();
+      if (_controlClient)
+        _controlClient->write(_transferError);
+    }
+  }
+
+  if (_sink || _comparing)
+    _abortStore();
+  _finishPending = false;
+  _endDigest();
+  _endCodec();
+  _endList();
+  _endHot();
+  _producer = nullptr;
+  if (_file)
+    _file.close();
+
+  _fs = nullptr;
+  _command = FTP_COMMAND_NONE;
+  _controlClient = nullptr;
+}
+
+bool AsyncFTPPasiveServer::busy() const
+{
+  return _command != FTP_COMMAND_NONE;
+}
+
+void AsyncFTPPasiveServer::setHotFile(FTPHotFileRef file, size_t offset)
+{
+  _hotFile = file;
+  _hotPos = offset;
+}
+
+void AsyncFTPPasiveServer::setProducer(const FTPVirtualFile &file, size_t offset)
+{
+  _producer = file.producer;
+  _producerArg = file.arg;
+  _producerPos = offset;
 }
 
-void AsyncFTPPasiveServer::setCommand(FTPCommand c, File f, FS *fs)
+void AsyncFTPPasiveServer::setSink(const FTPVirtualFile &file)
+{
+  _sink = file.sink;
+  _sinkArg = file.sinkArg;
+}
+
+void AsyncFTPPasiveServer::setSkipIdentical()
+{
+  _comparing = true;
+  _compared = 0;
+}
+
+void AsyncFTPPasiveServer::setStoreDigest(FTPHashAlgorithm algorithm, const String &expected, bool whole)
+{
+  _digestEnabled = true;
+  _digestAlgorithm = algorithm;
+  _expectedDigest = expected;
+  _digestWhole = whole;
+}
+
+void AsyncFTPPasiveServer::setCommand(FTPCommand c, File f, FS *fs, size_t length)
 {
   if (_command != FTP_COMMAND_NONE)
     return;
@@ -211,36 +1238,89 @@ void AsyncFTPPasiveServer::setCommand(FTPCommand c, File f, FS *fs)
   _command = c;
   _file = f;
   _fs = fs;
+  _transferError = nullptr;
 
   switch (_command)
   {
   case FTP_COMMAND_STOR:
-    _remainingSpace = 0;
-
-#if FTP_USE_LITTLEFS
-    if (_fs == &LittleFS)
-      _remainingSpace = LittleFS.totalBytes() - LittleFS.usedBytes();
-#endif
+    _remainingSpace = _ftpServer->freeSpace(_fs);
+    _storeStartSize = _file ? _file.size() : 0;
+    _rxHeld = 0;
+    _rxThrottled = false;
+    _rxStalled = false;
+    _resetWriteBuf();
+    if (_digestEnabled)
+    {
+      _storeDigest = new AsyncFTPDigest();
+      if (_storeDigest)
+        _storeDigest->begin(_digestAlgorithm);
+      else
+        _transferError = "451 Insufficient memory for checksum.";
+    }
+    if (_sink && !_sink(_sinkArg, FTP_SINK_BEGIN, nullptr, 0))
+    {
+      _sink = nullptr;
+      _transferError = "451 Upload target not ready.";
+    }
+    break;
 
-#if FTP_USE_SDFS
-    else if (_fs == &SD)
-      _remainingSpace = SD.totalBytes() - SD.usedBytes();
-#endif
+  case FTP_COMMAND_RETR:
+    _resetSendRing();
+    _sendRemaining = length;
+    break;
 
-    _storeSuccess = true;
+  case FTP_COMMAND_LIST:
+  case FTP_COMMAND_MLSD:
+    _resetSendRing();
+    _resetList();
     break;
   }
 
+  if (_controlClient->transmissionMode() == FTP_MODE_DEFLATE)
+  {
+    // Only whole-file downloads can be served from or stored in a sidecar.
+    bool sidecar = FTP_SIDECAR_CACHE && _command == FTP_COMMAND_RETR && _fs && _file &&
+                   length == SIZE_MAX && !_file.position();
+    bool ready;
+    if (_command == FTP_COMMAND_STOR)
+    {
+      _inflate = new AsyncFTPInflate();
+      ready = _inflate && _inflate->begin(FTP_INFLATE_WINDOW_BITS);
+    }
+    else if (sidecar && _sidecar.open(*_fs, _file))
+      ready = true;
+    else
+    {
+      _deflate = new AsyncFTPDeflate();
+      ready = _deflate && _deflate->begin();
+      if (ready && sidecar)
+        _sidecarCreated = _sidecar.create(*_fs, _file);
+      if (_sidecarCreated)
+        _ftpServer->invalidatePath(_fs, _file.path());
+    }
+
+    if (!ready)
+    {
+      _endCodec();
+      _transferError = "451 Insufficient memory for MODE Z.";
+    }
+  }
+
+  // A hot enough whole-file download is captured for the hot-file tier.
+  if (_command == FTP_COMMAND_RETR && !_hotFile && !_sidecar.reading() && _fs && _file &&
+      length == SIZE_MAX && !_file.position() && _ftpServer->hotCacheBudget())
+  {
+    _hotKey = _ftpServer->virtualPath(_fs, _file.path());
+    _hotCapture = _ftpServer->admitHotFile(_hotKey, _file.size());
+    _hotCapturePos = 0;
+    _hotGeneration = _ftpServer->cacheGeneration();
+  }
+
   _tryStartTransfer();
 }
 
 void AsyncFTPPasiveServer::end(void)
 {
-  if (_client)
-  {
-    _client->close();
-    _client = nullptr;
-  }
-
+  detach();
   _server.end();
 }
@@ -0,0 +1,16 @@
+#include "ESPAsyncFTPServer.h"
+
+bool AsyncFTPRewriteJob::step()
+{
+  return _channel && _channel->copyPrefix();
+}
+
+void AsyncFTPRewriteJob::cancel()
+{
+  _channel = nullptr;
+}
+
+String AsyncFTPRewriteJob::status() const
+{
+  return "Rewriting upload.";
+}
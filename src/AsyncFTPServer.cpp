@@ -6,10 +6,24 @@ void AsyncFTPServer::begin(const char *user, const char *password)
   _password = password;
 
 #if FTP_USE_LITTLEFS
-  _littleFSAvailable = LittleFS.begin();
+  if (LittleFS.begin())
+    mount(FTP_LITTLEFS_ROOT_PATH, LittleFS,
+          [](uint64_t &total, uint64_t &used)
+          {
+            total = LittleFS.totalBytes();
+            used = LittleFS.usedBytes();
+            return true;
+          });
 #endif
 #if FTP_USE_SDFS
-  _sdFSAvailable = SD.begin();
+  if (SD.begin())
+    mount(FTP_SDFS_ROOT_PATH, SD,
+          [](uint64_t &total, uint64_t &used)
+          {
+            total = SD.totalBytes();
+            used = SD.usedBytes();
+            return true;
+          });
 #endif
 
   _server.onClient(
@@ -19,6 +33,7 @@ void AsyncFTPServer::begin(const char *user, const char *password)
           return;
 
         AsyncFTPServer *server = static_cast<AsyncFTPServer *>(s);
+        AsyncFTPLock lock(server);
         AsyncFTPClient *client = new AsyncFTPClient(server, c);
 
         if (!client)
@@ -27,6 +42,265 @@ void AsyncFTPServer::begin(const char *user, const char *password)
       this);
 
   _server.begin();
+
+  _initPassivePool();
+}
+
+void AsyncFTPServer::loop()
+{
+  // Reading usage can walk a filesystem's whole block map, so it runs without
+  // the lock, which is only taken to pick a stale mount and to publish what
+  // was read. The job slice below is all that runs under the lock.
+  for (size_t i = 0;; i++)
+  {
+    FS *fs;
+    AsyncFTPUsageHandler usage;
+    uint32_t changed;
+    {
+      AsyncFTPLock lock(this);
+      if (i >= _mounts.size())
+        break;
+
+      FTPMount &mount = _mounts[i];
+      if (!mount.stale || millis() - mount.changed < FTP_SPACE_RESYNC_DELAY)
+        continue;
+
+      fs = mount.fs;
+      usage = mount.usage;
+      changed = mount.changed;
+    }
+
+    uint64_t total = 0;
+    uint64_t used = 0;
+    bool sized = usage && usage(total, used);
+
+    // A write in the meantime leaves the mount stale for the next pass.
+    AsyncFTPLock lock(this);
+    FTPMount *mount = _mountOf(fs);
+    if (mount && mount->changed == changed)
+    {
+      mount->total = total;
+      mount->used = used;
+      mount->sized = sized;
+      mount->stale = false;
+    }
+  }
+
+  AsyncFTPLock lock(this);
+  _loopCalled = true;
+
+  // Jobs take turns one step at a time until the slice is used up; the next
+  // call resumes with the job after the last one that ran.
+  uint32_t start = micros();
+  bool pending = true;
+  while (pending)
+  {
+    pending = false;
+    for (size_t n = 0; n < FTP_JOBS_MAX; n++)
+    {
+      size_t i = (_jobNext + n) % FTP_JOBS_MAX;
+      if (!_jobs[i])
+        continue;
+
+      if (_jobs[i]->step())
+        pending = true;
+      else
+      {
+        delete _jobs[i];
+        _jobs[i] = nullptr;
+      }
+
+      if (micros() - start >= _jobSliceBudget)
+      {
+        _jobNext = (i + 1) % FTP_JOBS_MAX;
+        return;
+      }
+    }
+  }
+}
+
+bool AsyncFTPServer::startJob(AsyncFTPJob *job)
+{
+  // Nothing would advance the job without loop(), so it finishes right away,
+  // as cross-filesystem moves did before jobs existed.
+  if (!_loopCalled)
+  {
+    while (job->step())
+      ;
+    delete job;
+    return true;
+  }
+
+  for (AsyncFTPJob *&slot : _jobs)
+  {
+    if (!slot)
+    {
+      slot = job;
+      return true;
+    }
+  }
+  return false;
+}
+
+AsyncFTPJob *AsyncFTPServer::findJob(AsyncFTPClient *client) const
+{
+  for (AsyncFTPJob *job : _jobs)
+    if (job && job->client() == client)
+      return job;
+  return nullptr;
+}
+
+void AsyncFTPServer::detachJobs(AsyncFTPClient *client)
+{
+  for (AsyncFTPJob *job : _jobs)
+    if (job && job->client() == client)
+      job->detach();
+}
+
+void AsyncFTPServer::setJobSliceBudget(uint32_t us)
+{
+  _jobSliceBudget = us;
+}
+
+uint32_t AsyncFTPServer::jobSliceBudget() const
+{
+  return _jobSliceBudget;
+}
+
+void AsyncFTPServer::lock()
+{
+#if defined(ESP32)
+  _mutex.lock();
+#endif
+}
+
+void AsyncFTPServer::unlock()
+{
+#if defined(ESP32)
+  _mutex.unlock();
+#endif
+}
+
+AsyncFTPServer::~AsyncFTPServer()
+{
+  for (AsyncFTPJob *job : _jobs)
+    delete job;
+
+  for (AsyncFTPPasiveServer *pasv : _pasvPool)
+    delete pasv;
+}
+
+void AsyncFTPServer::setPassivePortRange(uint16_t min, uint16_t max)
+{
+  if (min > max)
+    std::swap(min, max);
+
+  _pasvPortMin = min;
+  _pasvPortMax = max;
+}
+
+void AsyncFTPServer::_initPassivePool()
+{
+  _pasvPorts.assign(((size_t)_pasvPortMax - _pasvPortMin + 1 + 31) / 32, 0);
+  _pasvPortNext = random(0, (long)_pasvPortMax - _pasvPortMin + 1);
+
+  // Bind the pooled listeners up front so PASV does not pay for it.
+  for (int attempt = 0; _pasvPool.size() < FTP_PASV_POOL_SIZE && attempt < FTP_PASV_POOL_SIZE * 4; attempt++)
+  {
+    uint16_t port = _allocatePassivePort();
+    if (!port)
+      break;
+
+    AsyncFTPPasiveServer *pasv = new AsyncFTPPasiveServer(this, port);
+    if (pasv && pasv->listening())
+      _pasvPool.push_back(pasv);
+    else
+      delete pasv;
+  }
+}
+
+uint16_t AsyncFTPServer::_allocatePassivePort()
+{
+  size_t count = (size_t)_pasvPortMax - _pasvPortMin + 1;
+
+  for (size_t n = 0; n < count; n++)
+  {
+    size_t i = (_pasvPortNext + n) % count;
+    uint32_t &word = _pasvPorts[i / 32];
+
+    if (word == UINT32_MAX)
+    {
+      n += 31 - i % 32;
+      continue;
+    }
+
+    uint32_t bit = 1UL << (i % 32);
+    if (word & bit)
+      continue;
+
+    word |= bit;
+    _pasvPortNext = (i + 1) % count;
+    return _pasvPortMin + i;
+  }
+
+  return 0;
+}
+
+void AsyncFTPServer::_freePassivePort(uint16_t port)
+{
+  if (port < _pasvPortMin || port > _pasvPortMax)
+    return;
+
+  size_t i = port - _pasvPortMin;
+  _pasvPorts[i / 32] &= ~(1UL << (i % 32));
+}
+
+AsyncFTPPasiveServer *AsyncFTPServer::acquirePassive(AsyncFTPClient *client)
+{
+  AsyncFTPPasiveServer *pasv = nullptr;
+
+  if (!_pasvPool.empty())
+  {
+    pasv = _pasvPool.back();
+    _pasvPool.pop_back();
+  }
+
+  // Ports another socket already holds stay marked as used.
+  for (int attempt = 0; !pasv && attempt < 4; attempt++)
+  {
+    uint16_t port = _allocatePassivePort();
+    if (!port)
+      break;
+
+    pasv = new AsyncFTPPasiveServer(this, port);
+    if (pasv && !pasv->listening())
+    {
+      delete pasv;
+      pasv = nullptr;
+    }
+  }
+
+  if (pasv)
+    pasv->attach(client);
+  return pasv;
+}
+
+void AsyncFTPServer::releasePassive(AsyncFTPPasiveServer *pasv)
+{
+  if (!pasv)
+    return;
+
+  pasv->detach();
+
+  if (_pasvPool.size() < FTP_PASV_POOL_SIZE)
+  {
+    _pasvPool.push_back(pasv);
+    return;
+  }
+
+  uint16_t port = pasv->port();
+  delete pasv;
+  _freePassivePort(port);
 }
 
 const char *AsyncFTPServer::user() const
@@ -39,41 +313,822 @@ const char *AsyncFTPServer::password() const
   return _password;
 }
 
-#if FTP_USE_LITTLEFS
-bool AsyncFTPServer::littleFSAvailable() const
+bool AsyncFTPServer::on(const char *verb, AsyncFTPCommandHandler handler, void *arg)
 {
-  return _littleFSAvailable;
+  size_t len = strlen(verb);
+  if (len < 3 || len > 4)
+    return false;
+
+  uint32_t packed = ftpVerb(verb);
+  auto it = std::lower_bound(_commands.begin(), _commands.end(), packed,
+                             [](const CommandEntry &e, uint32_t v)
+                             { return e.verb < v; });
+
+  if (it != _commands.end() && it->verb == packed)
+  {
+    it->handler = handler;
+    it->arg = arg;
+  }
+  else
+    _commands.insert(it, {packed, handler, arg});
+
+  return true;
 }
-#endif
 
-#if FTP_USE_SDFS
-bool AsyncFTPServer::sdFSAvailable() const
+bool AsyncFTPServer::dispatchCommand(uint32_t verb, AsyncFTPClient *client)
 {
-  return _sdFSAvailable;
+  auto it = std::lower_bound(_commands.begin(), _commands.end(), verb,
+                             [](const CommandEntry &e, uint32_t v)
+                             { return e.verb < v; });
+
+  if (it == _commands.end() || it->verb != verb || !it->handler)
+    return false;
+
+  it->handler(it->arg, client);
+  return true;
 }
-#endif
 
-bool AsyncFTPServer::resolveFsPath(const String &virtualPath, FS *&fs, String &fsPath, bool checkExists) const
+void AsyncFTPServer::setTransferMode(FTPTransferMode mode)
 {
-#if FTP_USE_LITTLEFS
-  if (virtualPath.startsWith(FTP_LITTLEFS_ROOT_PATH) && _littleFSAvailable)
+  _transferMode = mode;
+}
+
+FTPTransferMode AsyncFTPServer::transferMode() const
+{
+  return _transferMode;
+}
+
+void AsyncFTPServer::setFlushPolicy(FTPFlushPolicy policy, size_t blockSize)
+{
+  if (!blockSize || blockSize > FTP_WRITE_BUFFER_SIZE)
+    blockSize = FTP_WRITE_BUFFER_SIZE;
+
+  _flushPolicy = policy;
+  _flushBlockSize = blockSize;
+}
+
+FTPFlushPolicy AsyncFTPServer::flushPolicy() const
+{
+  return _flushPolicy;
+}
+
+size_t AsyncFTPServer::flushBlockSize() const
+{
+  return _flushBlockSize;
+}
+
+void AsyncFTPServer::setReceiveWatermarks(size_t low, size_t high)
+{
+  _rxLowWatermark = low < high ? low : high;
+  _rxHighWatermark = high;
+}
+
+size_t AsyncFTPServer::receiveLowWatermark() const
+{
+  return _rxLowWatermark;
+}
+
+size_t AsyncFTPServer::receiveHighWatermark() const
+{
+  return _rxHighWatermark;
+}
+
+static int comparePrefix(const String &prefix, const char *path, size_t len)
+{
+  size_t prefixLen = prefix.length();
+  int cmp = memcmp(prefix.c_str(), path, prefixLen < len ? prefixLen : len);
+  if (cmp)
+    return cmp;
+  return prefixLen < len ? -1 : prefixLen > len;
+}
+
+bool AsyncFTPServer::mount(const char *prefix, FS &fs, AsyncFTPUsageHandler usage)
+{
+  size_t len = strlen(prefix);
+  if (len < 2 || prefix[0] != '/' || prefix[len - 1] == '/')
+    return false;
+
+  auto it = std::lower_bound(_mounts.begin(), _mounts.end(), prefix,
+                             [len](const FTPMount &m, const char *p)
+                             { return comparePrefix(m.prefix, p, len) < 0; });
+  if (it != _mounts.end() && !comparePrefix(it->prefix, prefix, len))
+    return false;
+
+  it = _mounts.insert(it, {prefix, &fs, usage, false, 0, 0, false, 0});
+  _queryUsage(*it);
+  invalidatePath(prefix);
+  return true;
+}
+
+bool AsyncFTPServer::unmount(const char *prefix)
+{
+  size_t len = strlen(prefix);
+  for (auto it = _mounts.begin(); it != _mounts.end(); ++it)
   {
-    fs = &LittleFS;
-    fsPath = virtualPath.substring(virtualPath.indexOf("/", 1));
-    return !checkExists || fs->exists(fsPath);
+    if (!comparePrefix(it->prefix, prefix, len))
+    {
+      _mounts.erase(it);
+      invalidatePath(prefix);
+      return true;
+    }
   }
-#endif
+  return false;
+}
 
-#if FTP_USE_SDFS
-  if (virtualPath.startsWith(FTP_SD_ROOT_PATH) && _sdFSAvailable)
+size_t AsyncFTPServer::mountCount() const
+{
+  return _mounts.size();
+}
+
+const FTPMount *AsyncFTPServer::mountAt(size_t index) const
+{
+  return index < _mounts.size() ? &_mounts[index] : nullptr;
+}
+
+const FTPMount *AsyncFTPServer::_findMount(const char *path, size_t len) const
+{
+  // Probe each component boundary from the longest prefix down.
+  for (size_t end = len; end > 1; end--)
+  {
+    if (end != len && path[end] != '/')
+      continue;
+
+    auto it = std::lower_bound(_mounts.begin(), _mounts.end(), path,
+                               [end](const FTPMount &m, const char *p)
+                               { return comparePrefix(m.prefix, p, end) < 0; });
+    if (it != _mounts.end() && !comparePrefix(it->prefix, path, end))
+      return &*it;
+  }
+
+  return nullptr;
+}
+
+FTPMount *AsyncFTPServer::_mountOf(FS *fs)
+{
+  for (FTPMount &mount : _mounts)
+    if (mount.fs == fs)
+      return &mount;
+  return nullptr;
+}
+
+void AsyncFTPServer::_queryUsage(FTPMount &mount)
+{
+  mount.sized = mount.usage && mount.usage(mount.total, mount.used);
+  mount.stale = false;
+}
+
+uint64_t AsyncFTPServer::totalSpace(FS *fs)
+{
+  FTPMount *mount = _mountOf(fs);
+  return mount && mount->sized ? mount->total : 0;
+}
+
+uint64_t AsyncFTPServer::usedSpace(FS *fs)
+{
+  FTPMount *mount = _mountOf(fs);
+  return mount && mount->sized ? mount->used : 0;
+}
+
+uint64_t AsyncFTPServer::freeSpace(FS *fs)
+{
+  FTPMount *mount = _mountOf(fs);
+  if (!mount || !mount->sized)
+    return UINT64_MAX;
+  return mount->total > mount->used ? mount->total - mount->used : 0;
+}
+
+void AsyncFTPServer::adjustUsedSpace(FS *fs, int64_t delta)
+{
+  FTPMount *mount = _mountOf(fs);
+  if (!mount || !mount->sized)
+    return;
+
+  if (delta < 0 && (uint64_t)-delta > mount->used)
+    mount->used = 0;
+  else
+    mount->used += delta;
+
+  // Block rounding and metadata are only visible to the filesystem itself.
+  mount->stale = true;
+  mount->changed = millis();
+}
+
+const FTPUploadStats &AsyncFTPServer::uploadStats() const
+{
+  return _uploadStats;
+}
+
+void AsyncFTPServer::setUploadDigest(bool enabled)
+{
+  _uploadDigest = enabled;
+}
+
+bool AsyncFTPServer::uploadDigest() const
+{
+  return _uploadDigest;
+}
+
+void AsyncFTPServer::setSkipIdentical(bool enabled)
+{
+  _skipIdentical = enabled;
+}
+
+bool AsyncFTPServer::skipIdentical() const
+{
+  return _skipIdentical;
+}
+
+void AsyncFTPServer::recordUpload(size_t bytes, uint32_t fsWrites, size_t written)
+{
+  _uploadStats.uploads++;
+  _uploadStats.fsWrites += fsWrites;
+  _uploadStats.bytes += bytes;
+  _uploadStats.bytesWritten += written;
+  _uploadStats.lastFsWrites = fsWrites;
+  _uploadStats.lastBytes = bytes;
+  _uploadStats.lastBytesWritten = written;
+}
+
+void AsyncFTPServer::setListCacheBudget(size_t bytes)
+{
+  _listCacheBudget = bytes;
+  _evictListings(bytes);
+}
+
+size_t AsyncFTPServer::listCacheBudget() const
+{
+  return _listCacheBudget;
+}
+
+FTPListing AsyncFTPServer::findListing(const String &virtualPath, FTPCommand command)
+{
+  String key = pathKey(virtualPath);
+
+  for (ListEntry &entry : _listCache)
+  {
+    if (entry.command == command && entry.path == key)
+    {
+      entry.lastUse = ++_cacheClock;
+      return entry.listing;
+    }
+  }
+
+  return FTPListing();
+}
+
+void AsyncFTPServer::storeListing(const String &virtualPath, FTPCommand command, std::vector<uint8_t> &&data,
+                                  uint32_t generation)
+{
+  if (data.size() > _listCacheBudget || generation != _cacheGeneration)
+    return;
+
+  String key = pathKey(virtualPath);
+  for (size_t i = _listCache.size(); i--;)
+    if (_listCache[i].command == command && _listCache[i].path == key)
+      _dropListing(i);
+
+  // Sessions still replaying an evicted listing keep their own reference.
+  _evictListings(_listCacheBudget - data.size());
+
+  data.shrink_to_fit();
+  _listCacheSize += data.size();
+  _listCache.push_back({key, command, std::make_shared<const std::vector<uint8_t>>(std::move(data)), ++_cacheClock});
+}
+
+void AsyncFTPServer::setHotCacheBudget(size_t bytes)
+{
+  _hotCacheBudget = bytes;
+  while (_hotCacheSize > _hotCacheBudget)
+  {
+    _hotCacheSize -= _hotCache.front().file->size;
+    _hotCache.erase(_hotCache.begin());
+  }
+}
+
+size_t AsyncFTPServer::hotCacheBudget() const
+{
+  return _hotCacheBudget;
+}
+
+uint8_t AsyncFTPServer::_hotFrequency(const String &key, bool touch)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < key.length(); i++)
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+
+  uint8_t &a = _hotFreq[(hash & 0xFFFF) % FTP_HOT_SKETCH_SIZE];
+  uint8_t &b = _hotFreq[(hash >> 16) % FTP_HOT_SKETCH_SIZE];
+
+  if (touch)
+  {
+    if (a < 255)
+      a++;
+    if (b < 255)
+      b++;
+
+    // Halve all counters periodically so that old popularity fades out.
+    if (++_hotFreqSamples >= FTP_HOT_SKETCH_SIZE * 8)
+    {
+      for (uint8_t &count : _hotFreq)
+        count >>= 1;
+      _hotFreqSamples = 0;
+    }
+  }
+
+  return a < b ? a : b;
+}
+
+bool AsyncFTPServer::_evictHotFiles(size_t size, uint8_t freq, bool apply)
+{
+  // Residents are displaced coldest first, and only by a hotter candidate.
+  std::vector<std::pair<uint8_t, size_t>> order;
+  for (size_t i = 0; i < _hotCache.size(); i++)
+    order.push_back({_hotFrequency(_hotCache[i].path, false), i});
+  std::sort(order.begin(), order.end());
+
+  size_t available = _hotCacheBudget - _hotCacheSize;
+  size_t count = 0;
+  while (available < size && count < order.size() && order[count].first < freq)
+    available += _hotCache[order[count++].second].file->size;
+
+  if (available < size)
+    return false;
+
+  if (apply)
   {
-    fs = &LittleFS;
-    fsPath = virtualPath.substring(virtualPath.indexOf("/", 1));
-    return !checkExists || fs->exists(fsPath);
+    std::vector<size_t> victims;
+    for (size_t i = 0; i < count; i++)
+      victims.push_back(order[i].second);
+    std::sort(victims.rbegin(), victims.rend());
+
+    for (size_t index : victims)
+    {
+      _hotCacheSize -= _hotCache[index].file->size;
+      _hotCache.erase(_hotCache.begin() + index);
+    }
   }
+
+  return true;
+}
+
+FTPHotFileRef AsyncFTPServer::findHotFile(const String &virtualPath)
+{
+  if (!_hotCacheBudget)
+    return FTPHotFileRef();
+
+  String key = pathKey(virtualPath);
+  _hotFrequency(key, true);
+
+  for (HotEntry &entry : _hotCache)
+  {
+    if (entry.path == key)
+    {
+      _hotCacheStats.hits++;
+      return entry.file;
+    }
+  }
+
+  _hotCacheStats.misses++;
+  return FTPHotFileRef();
+}
+
+std::shared_ptr<FTPHotFile> AsyncFTPServer::admitHotFile(const String &virtualPath, size_t size)
+{
+  if (!size || size > _hotCacheBudget)
+    return nullptr;
+
+  String key = pathKey(virtualPath);
+  uint8_t freq = _hotFrequency(key, false);
+  if (freq < FTP_HOT_ADMIT_COUNT || !_evictHotFiles(size, freq, false))
+    return nullptr;
+
+  uint8_t *data = nullptr;
+#if defined(BOARD_HAS_PSRAM)
+  data = (uint8_t *)ps_malloc(size);
 #endif
+  if (!data)
+    data = (uint8_t *)malloc(size);
+  if (!data)
+    return nullptr;
 
-  return false;
+  return std::shared_ptr<FTPHotFile>(new FTPHotFile{data, size});
+}
+
+void AsyncFTPServer::storeHotFile(const String &virtualPath, std::shared_ptr<FTPHotFile> file, uint32_t generation)
+{
+  if (generation != _cacheGeneration)
+    return;
+
+  String key = pathKey(virtualPath);
+  for (size_t i = 0; i < _hotCache.size(); i++)
+  {
+    if (_hotCache[i].path == key)
+    {
+      _hotCacheSize -= _hotCache[i].file->size;
+      _hotCache.erase(_hotCache.begin() + i);
+      break;
+    }
+  }
+
+  if (!_evictHotFiles(file->size, _hotFrequency(key, false), true))
+    return;
+
+  _hotCacheSize += file->size;
+  _hotCache.push_back({key, file});
+}
+
+void AsyncFTPServer::recordHotBytes(size_t bytes)
+{
+  _hotCacheStats.bytesServed += bytes;
+}
+
+const FTPHotCacheStats &AsyncFTPServer::hotCacheStats() const
+{
+  return _hotCacheStats;
+}
+
+uint32_t AsyncFTPServer::cacheGeneration() const
+{
+  return _cacheGeneration;
+}
+
+bool AsyncFTPServer::findDigest(const String &virtualPath, FTPHashAlgorithm algorithm, String &digest)
+{
+  String key = pathKey(virtualPath);
+
+  for (DigestEntry &entry : _digestCache)
+  {
+    if (entry.algorithm == algorithm && entry.path == key)
+    {
+      entry.lastUse = ++_cacheClock;
+      digest = entry.digest;
+      return true;
+    }
+  }
+
+  FS *fs;
+  String fsPath;
+  FTPFileStat st;
+  if (!_digestSidecar || !resolveFsPath(key, fs, fsPath) || !stat(key, st) || st.isDirectory ||
+      !AsyncFTPDigest::loadSidecar(*fs, fsPath, algorithm, st, digest))
+    return false;
+
+  _cacheDigest(key, algorithm, digest);
+  return true;
+}
+
+void AsyncFTPServer::storeDigest(const String &virtualPath, FTPHashAlgorithm algorithm, const String &digest,
+                                 uint32_t generation, bool persist)
+{
+  if (generation != _cacheGeneration)
+    return;
+
+  String key = pathKey(virtualPath);
+  FS *fs;
+  String fsPath;
+  FTPFileStat st;
+  if (persist && _digestSidecar && !key.endsWith(FTP_DIGEST_SUFFIX) && resolveFsPath(key, fs, fsPath) && stat(key, st) && !st.isDirectory &&
+      AsyncFTPDigest::storeSidecar(*fs, fsPath, algorithm, digest, st))
+  {
+    // The sidecar shows up in its directory's listing and in the usage.
+    invalidatePath(AsyncFTPDigest::sidecarPath(key));
+    adjustUsedSpace(fs, 0);
+  }
+
+  _cacheDigest(key, algorithm, digest);
+}
+
+void AsyncFTPServer::setDigestSidecar(bool enabled)
+{
+  _digestSidecar = enabled;
+}
+
+bool AsyncFTPServer::digestSidecar() const
+{
+  return _digestSidecar;
+}
+
+void AsyncFTPServer::_cacheDigest(const String &key, FTPHashAlgorithm algorithm, const String &digest)
+{
+  DigestEntry *victim = &_digestCache[0];
+  for (DigestEntry &entry : _digestCache)
+  {
+    if (entry.algorithm == algorithm && entry.path == key)
+    {
+      victim = &entry;
+      break;
+    }
+    if (entry.lastUse < victim->lastUse)
+      victim = &entry;
+  }
+
+  victim->path = key;
+  victim->algorithm = algorithm;
+  victim->digest = digest;
+  victim->lastUse = ++_cacheClock;
+}
+
+static bool virtualFileLess(const FTPVirtualFile &file, const String &path)
+{
+  return strcmp(file.path.c_str(), path.c_str()) < 0;
+}
+
+bool AsyncFTPServer::addVirtualFile(const char *path, AsyncFTPFileProducer producer, void *arg, size_t sizeHint)
+{
+  AsyncFTPLock lock(this);
+  String key = pathKey(path);
+  if (key == FTP_ROOT_PATH || !producer)
+    return false;
+
+  auto it = std::lower_bound(_virtualFiles.begin(), _virtualFiles.end(), key, virtualFileLess);
+  if (it != _virtualFiles.end() && it->path == key)
+  {
+    it->producer = producer;
+    it->arg = arg;
+    it->sizeHint = sizeHint;
+  }
+  else
+    _virtualFiles.insert(it, {key, producer, arg, sizeHint, nullptr, nullptr});
+
+  invalidatePath(key);
+  return true;
+}
+
+bool AsyncFTPServer::addUploadSink(const char *path, AsyncFTPUploadSink sink, void *arg)
+{
+  AsyncFTPLock lock(this);
+  String key = pathKey(path);
+  if (key == FTP_ROOT_PATH || !sink)
+    return false;
+
+  auto it = std::lower_bound(_virtualFiles.begin(), _virtualFiles.end(), key, virtualFileLess);
+  if (it != _virtualFiles.end() && it->path == key)
+  {
+    it->sink = sink;
+    it->sinkArg = arg;
+  }
+  else
+    _virtualFiles.insert(it, {key, nullptr, nullptr, 0, sink, arg});
+
+  invalidatePath(key);
+  return true;
+}
+
+bool AsyncFTPServer::removeVirtualFile(const char *path)
+{
+  AsyncFTPLock lock(this);
+  String key = pathKey(path);
+  auto it = std::lower_bound(_virtualFiles.begin(), _virtualFiles.end(), key, virtualFileLess);
+  if (it == _virtualFiles.end() || it->path != key)
+    return false;
+
+  _virtualFiles.erase(it);
+  invalidatePath(key);
+  return true;
+}
+
+const FTPVirtualFile *AsyncFTPServer::findVirtualFile(const String &virtualPath) const
+{
+  if (_virtualFiles.empty())
+    return nullptr;
+
+  String key = pathKey(virtualPath);
+  auto it = std::lower_bound(_virtualFiles.begin(), _virtualFiles.end(), key, virtualFileLess);
+  return it != _virtualFiles.end() && it->path == key ? &*it : nullptr;
+}
+
+size_t AsyncFTPServer::virtualFileCount() const
+{
+  return _virtualFiles.size();
+}
+
+const FTPVirtualFile *AsyncFTPServer::virtualFileAt(size_t index) const
+{
+  return index < _virtualFiles.size() ? &_virtualFiles[index] : nullptr;
+}
+
+void AsyncFTPServer::_evictListings(size_t limit)
+{
+  while (_listCacheSize > limit)
+  {
+    size_t oldest = 0;
+    for (size_t i = 1; i < _listCache.size(); i++)
+      if (_listCache[i].lastUse < _listCache[oldest].lastUse)
+        oldest = i;
+    _dropListing(oldest);
+  }
+}
+
+void AsyncFTPServer::_dropListing(size_t index)
+{
+  _listCacheSize -= _listCache[index].listing->size();
+  _listCache.erase(_listCache.begin() + index);
+}
+
+String AsyncFTPServer::normalizePath(const String &input)
+{
+  String path = input;
+  path.replace("\\", "/");
+
+  if (!path.startsWith("/"))
+    path = "/" + path;
+
+  String out = "/";
+  int len = path.length();
+  int i = 1;
+
+  while (i < len)
+  {
+    while (i < len && path[i] == '/')
+      i++;
+
+    if (i >= len)
+      break;
+
+    int start = i;
+    while (i < len && path[i] != '/')
+      i++;
+
+    String token = path.substring(start, i);
+
+    if (token != ".")
+    {
+      if (token == "..")
+      {
+        int last = out.lastIndexOf('/', out.length() - 2);
+        if (last >= 0)
+          out = out.substring(0, last + 1);
+      }
+      else
+      {
+        out += token;
+        out += "/";
+      }
+    }
+  }
+
+  return out;
+}
+
+String AsyncFTPServer::pathKey(const String &virtualPath)
+{
+  String key = normalizePath(virtualPath);
+  if (key.length() > 1)
+    key.remove(key.length() - 1);
+  return key;
+}
+
+bool AsyncFTPServer::stat(const String &virtualPath, FTPFileStat &st)
+{
+  String key = pathKey(virtualPath);
+  StatEntry *victim = &_statCache[0];
+
+  const FTPVirtualFile *file = findVirtualFile(key);
+  if (file)
+  {
+    st = {true, false, file->sizeHint, 0};
+    return true;
+  }
+
+  uint32_t now = millis();
+  for (StatEntry &entry : _statCache)
+  {
+    // An expired entry is refreshed in place.
+    if (entry.path == key && now - entry.cachedAt >= _statCacheTtl)
+    {
+      victim = &entry;
+      break;
+    }
+
+    if (entry.path == key)
+    {
+      entry.lastUse = ++_cacheClock;
+      _statCacheStats.hits++;
+      st = entry.stat;
+      return st.exists;
+    }
+
+    if (entry.lastUse < victim->lastUse)
+      victim = &entry;
+  }
+
+  _statCacheStats.misses++;
+  st = {};
+
+  FS *fs;
+  String fsPath;
+  if (!resolveFsPath(key, fs, fsPath))
+    return false;
+
+  if (fs->exists(fsPath))
+  {
+    File file = fs->open(fsPath);
+    if (file)
+    {
+      st.exists = true;
+      st.isDirectory = file.isDirectory();
+      st.size = file.size();
+      st.lastWrite = file.getLastWrite();
+      file.close();
+    }
+  }
+
+  // Misses are cached as well, so repeated probes for a missing name are free.
+  victim->path = key;
+  victim->stat = st;
+  victim->lastUse = ++_cacheClock;
+  victim->cachedAt = now;
+  return st.exists;
+}
+
+void AsyncFTPServer::setStatCacheTtl(uint32_t ms)
+{
+  _statCacheTtl = ms;
+}
+
+uint32_t AsyncFTPServer::statCacheTtl() const
+{
+  return _statCacheTtl;
+}
+
+void AsyncFTPServer::invalidatePath(const String &virtualPath)
+{
+  AsyncFTPLock lock(this);
+  String key = pathKey(virtualPath);
+  String prefix = key.length() > 1 ? key + "/" : key;
+  String sidecar = AsyncFTPSidecar::pathFor(key);
+
+  // The file's sidecar is created and removed alongside it.
+  for (StatEntry &entry : _statCache)
+  {
+    if (entry.path == key || entry.path == sidecar || entry.path.startsWith(prefix))
+    {
+      entry.path = String();
+      entry.lastUse = 0;
+    }
+  }
+
+  for (DigestEntry &entry : _digestCache)
+  {
+    if (entry.path == key || entry.path.startsWith(prefix))
+    {
+      entry.path = String();
+      entry.lastUse = 0;
+    }
+  }
+
+  for (size_t i = _hotCache.size(); i--;)
+  {
+    const String &path = _hotCache[i].path;
+    if (path == key || path.startsWith(prefix))
+    {
+      _hotCacheSize -= _hotCache[i].file->size;
+      _hotCache.erase(_hotCache.begin() + i);
+    }
+  }
+
+  _cacheGeneration++;
+
+  int slash = key.lastIndexOf('/');
+  String parent = slash > 0 ? key.substring(0, slash) : String(FTP_ROOT_PATH);
+
+  for (size_t i = _listCache.size(); i--;)
+  {
+    const String &path = _listCache[i].path;
+    if (path == parent || path == key || path.startsWith(prefix))
+      _dropListing(i);
+  }
+}
+
+void AsyncFTPServer::invalidatePath(FS *fs, const String &fsPath)
+{
+  invalidatePath(virtualPath(fs, fsPath));
+}
+
+String AsyncFTPServer::virtualPath(FS *fs, const String &fsPath) const
+{
+  for (const FTPMount &mount : _mounts)
+    if (mount.fs == fs)
+      return mount.prefix + fsPath;
+
+  return String();
+}
+
+const FTPStatCacheStats &AsyncFTPServer::statCacheStats() const
+{
+  return _statCacheStats;
+}
+
+bool AsyncFTPServer::resolveFsPath(const String &virtualPath, FS *&fs, String &fsPath, bool checkExists) const
+{
+  const FTPMount *mount = _findMount(virtualPath.c_str(), virtualPath.length());
+  if (!mount)
+    return false;
+
+  const char *rest = virtualPath.c_str() + mount->prefix.length();
+  fs = mount->fs;
+  fsPath = *rest ? rest : FTP_ROOT_PATH;
+  return !checkExists || fs->exists(fsPath);
 }
 
 File AsyncFTPServer::resolveFile(const String &virtualPath, const char *mode, bool create)
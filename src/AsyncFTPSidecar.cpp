@@ -0,0 +1,268 @@
+#include "ESPAsyncFTPServer.h"
+
+// gzip member with one FEXTRA subfield "ZL" holding the zlib CMF/FLG and the
+// Adler-32 of the stream the body was cut from.
+#define SIDECAR_HEADER_SIZE 22
+#define SIDECAR_TRAILER_SIZE 8
+#define SIDECAR_FRAME_OFFSET 16
+
+static void putLE32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t getLE32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+AsyncFTPSidecar::~AsyncFTPSidecar()
+{
+  end();
+}
+
+String AsyncFTPSidecar::pathFor(const String &path)
+{
+  return path + FTP_SIDECAR_SUFFIX;
+}
+
+bool AsyncFTPSidecar::_readHeader(File &file, uint8_t *header)
+{
+  if (file.size() < SIDECAR_HEADER_SIZE + SIDECAR_TRAILER_SIZE ||
+      file.read(header, SIDECAR_HEADER_SIZE) != SIDECAR_HEADER_SIZE)
+    return false;
+
+  return header[0] == 0x1F && header[1] == 0x8B && header[2] == 8 && header[3] == 0x04 &&
+         header[10] == 10 && header[11] == 0 && header[12] == 'Z' && header[13] == 'L' &&
+         header[14] == 6 && header[15] == 0;
+}
+
+bool AsyncFTPSidecar::invalidate(FS &fs, const String &path)
+{
+  // Persisted digests describe the same content and go with it.
+  bool removed = AsyncFTPDigest::removeSidecar(fs, path);
+
+#if FTP_SIDECAR_CACHE
+  String sidecarPath = pathFor(path);
+  if (!fs.exists(sidecarPath))
+    return removed;
+
+  // Only remove files this class wrote; a user's own ".gz" stays put.
+  uint8_t header[SIDECAR_HEADER_SIZE];
+  File file = fs.open(sidecarPath, FILE_READ);
+  bool ours = file && _readHeader(file, header);
+  file.close();
+
+  if (ours && fs.remove(sidecarPath))
+    removed = true;
+#endif
+  return removed;
+}
+
+bool AsyncFTPSidecar::open(FS &fs, File &source)
+{
+  end();
+
+  String path = pathFor(source.path());
+  if (!fs.exists(path))
+    return false;
+
+  uint8_t header[SIDECAR_HEADER_SIZE];
+  uint8_t trailer[SIDECAR_TRAILER_SIZE];
+  _file = fs.open(path, FILE_READ);
+  if (!_file || !_readHeader(_file, header))
+  {
+    end();
+    return false;
+  }
+
+  size_t size = _file.size();
+  const uint8_t *frame = header + SIDECAR_FRAME_OFFSET;
+  bool fresh = (frame[0] & 0x0F) == 8 && !(((frame[0] << 8) | frame[1]) % 31) &&
+               getLE32(header + 4) == (uint32_t)source.getLastWrite() &&
+               _file.seek(size - SIDECAR_TRAILER_SIZE) &&
+               _file.read(trailer, sizeof(trailer)) == sizeof(trailer) &&
+               getLE32(trailer + 4) == (uint32_t)source.size() &&
+               _file.seek(SIDECAR_HEADER_SIZE);
+  if (!fresh)
+  {
+    end();
+    return false;
+  }
+
+  memcpy(_frame, frame, sizeof(_frame));
+  _framePos = 0;
+  _bodyLeft = size - SIDECAR_HEADER_SIZE - SIDECAR_TRAILER_SIZE;
+  return true;
+}
+
+bool AsyncFTPSidecar::create(FS &fs, File &source)
+{
+  end();
+
+  String sourcePath = source.path();
+  if (source.size() < FTP_SIDECAR_MIN_SIZE || sourcePath.endsWith(FTP_SIDECAR_SUFFIX))
+    return false;
+
+  String path = pathFor(sourcePath);
+  uint8_t header[SIDECAR_HEADER_SIZE];
+  if (fs.exists(path))
+  {
+    File file = fs.open(path, FILE_READ);
+    bool ours = file && _readHeader(file, header);
+    file.close();
+    if (!ours)
+      return false;
+  }
+
+  // The frame stays zeroed until commit(), so a partial file never looks fresh.
+  memset(header, 0, sizeof(header));
+  header[0] = 0x1F;
+  header[1] = 0x8B;
+  header[2] = 8;
+  header[3] = 0x04;
+  putLE32(header + 4, source.getLastWrite());
+  header[9] = 255;
+  header[10] = 10;
+  header[12] = 'Z';
+  header[13] = 'L';
+  header[14] = 6;
+
+  _file = fs.open(path, FILE_WRITE);
+  if (!_file || _file.write(header, sizeof(header)) != sizeof(header))
+  {
+    _file.close();
+    fs.remove(path);
+    return false;
+  }
+
+  _fs = &fs;
+  _writing = true;
+  _framePos = 0;
+  _held = 0;
+  _crc = 0;
+  _size = 0;
+  _expectedSize = source.size();
+  return true;
+}
+
+void AsyncFTPSidecar::end()
+{
+  if (!_file)
+    return;
+
+  // An unfinished sidecar is removed rather than left for the next open().
+  if (_writing)
+  {
+    String path = _file.path();
+    _file.close();
+    _fs->remove(path);
+  }
+
+  _file.close();
+  _writing = false;
+}
+
+size_t AsyncFTPSidecar::read(uint8_t *buf, size_t len)
+{
+  size_t size = 0;
+
+  while (size < len && _framePos < 2)
+    buf[size++] = _frame[_framePos++];
+
+  if (_bodyLeft && size < len)
+  {
+    size_t chunk = len - size < _bodyLeft ? len - size : _bodyLeft;
+    chunk = _file.read(buf + size, chunk);
+    if (!chunk)
+      _bodyLeft = 0;
+
+    size += chunk;
+    _bodyLeft -= chunk;
+  }
+
+  while (!_bodyLeft && size < len && _framePos < sizeof(_frame))
+    buf[size++] = _frame[_framePos++];
+
+  return size;
+}
+
+void AsyncFTPSidecar::update(const uint8_t *data, size_t len)
+{
+  if (!_writing)
+    return;
+
+  _crc = AsyncFTPDigest::crc32(_crc, data, len);
+  _size += len;
+}
+
+void AsyncFTPSidecar::write(const uint8_t *data, size_t len)
+{
+  if (!_writing)
+    return;
+
+  while (len && _framePos < 2)
+  {
+    _frame[_framePos++] = *data++;
+    len--;
+  }
+
+  // The last four stream bytes are held back; at the end they are the Adler-32.
+  uint8_t *held = _frame + 2;
+  if (_held + len <= 4)
+  {
+    memcpy(held + _held, data, len);
+    _held += len;
+    return;
+  }
+
+  size_t flush = _held + len - 4;
+  size_t fromHeld = flush < _held ? flush : _held;
+  size_t fromData = flush - fromHeld;
+
+  if ((fromHeld && _file.write(held, fromHeld) != fromHeld) ||
+      (fromData && _file.write(data, fromData) != fromData))
+  {
+    end();
+    return;
+  }
+
+  memmove(held, held + fromHeld, _held - fromHeld);
+  _held -= fromHeld;
+  memcpy(held + _held, data + fromData, len - fromData);
+  _held += len - fromData;
+}
+
+void AsyncFTPSidecar::commit()
+{
+  if (!_writing)
+    return;
+
+  if (_held != 4 || _size != _expectedSize)
+  {
+    end();
+    return;
+  }
+
+  uint8_t trailer[SIDECAR_TRAILER_SIZE];
+  putLE32(trailer, _crc);
+  putLE32(trailer + 4, _size);
+
+  if (_file.write(trailer, sizeof(trailer)) != sizeof(trailer) ||
+      !_file.seek(SIDECAR_FRAME_OFFSET) || _file.write(_frame, sizeof(_frame)) != sizeof(_frame))
+  {
+    end();
+    return;
+  }
+
+  _writing = false;
+  _file.close();
+}
+
+bool AsyncFTPSidecar::reading() const
+{
+  return _file && !_writing;
+}
@@ -2,6 +2,15 @@
 
 #include <Arduino.h>
 #include <AsyncTCP.h>
+#include <MD5Builder.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#if defined(ESP32)
+#include <mbedtls/sha256.h>
+#include <mutex>
+#endif
 
 #define FTP_ROOT_PATH "/"
 
@@ -29,8 +38,138 @@
 #ifndef FTP_PASV_PORT_MAX
 #define FTP_PASV_PORT_MAX 65535
 #endif
+#ifndef FTP_DATA_CHANNELS_MAX
+#define FTP_DATA_CHANNELS_MAX 4
+#endif
+#ifndef FTP_PASV_POOL_SIZE
+#define FTP_PASV_POOL_SIZE 1
+#endif
+
+#ifndef FTP_COMMAND_LINE_MAX
+#define FTP_COMMAND_LINE_MAX 512
+#endif
+
+#ifndef FTP_REPLY_BUFFER_SIZE
+#define FTP_REPLY_BUFFER_SIZE 512
+#endif
+#ifndef FTP_REPLY_LINE_MAX
+#define FTP_REPLY_LINE_MAX 320
+#endif
+
+// writef() formats straight into the reply buffer after making room for one line.
+static_assert(FTP_REPLY_LINE_MAX > 3 && FTP_REPLY_BUFFER_SIZE >= FTP_REPLY_LINE_MAX,
+              "FTP_REPLY_BUFFER_SIZE must hold at least one FTP_REPLY_LINE_MAX line");
+
+#ifndef FTP_SEND_BUFFER_SIZE
+#define FTP_SEND_BUFFER_SIZE 2048
+#endif
+#ifndef FTP_SEND_BUFFER_COUNT
+#define FTP_SEND_BUFFER_COUNT 3
+#endif
+#ifndef FTP_WRITE_BUFFER_SIZE
+#define FTP_WRITE_BUFFER_SIZE 4096
+#endif
+#ifndef FTP_LIST_LINE_MAX
+#define FTP_LIST_LINE_MAX 320
+#endif
+#ifndef FTP_DEFLATE_WINDOW_BITS
+#define FTP_DEFLATE_WINDOW_BITS 12
+#endif
+#ifndef FTP_DEFLATE_HASH_BITS
+#define FTP_DEFLATE_HASH_BITS 11
+#endif
+#ifndef FTP_INFLATE_WINDOW_BITS
+#define FTP_INFLATE_WINDOW_BITS 15
+#endif
+#ifndef FTP_STAT_CACHE_SIZE
+#define FTP_STAT_CACHE_SIZE 16
+#endif
+#ifndef FTP_STAT_CACHE_TTL
+#define FTP_STAT_CACHE_TTL 2000
+#endif
+#ifndef FTP_SPACE_RESYNC_DELAY
+#define FTP_SPACE_RESYNC_DELAY 10000
+#endif
+#ifndef FTP_LIST_CACHE_BUDGET
+#define FTP_LIST_CACHE_BUDGET 0
+#endif
+#ifndef FTP_HOT_CACHE_BUDGET
+#define FTP_HOT_CACHE_BUDGET 0
+#endif
+#ifndef FTP_HOT_ADMIT_COUNT
+#define FTP_HOT_ADMIT_COUNT 3
+#endif
+#ifndef FTP_HOT_SKETCH_SIZE
+#define FTP_HOT_SKETCH_SIZE 256
+#endif
+#ifndef FTP_SIDECAR_CACHE
+#define FTP_SIDECAR_CACHE 1
+#endif
+#ifndef FTP_SIDECAR_SUFFIX
+#define FTP_SIDECAR_SUFFIX ".gz"
+#endif
+#ifndef FTP_SIDECAR_MIN_SIZE
+#define FTP_SIDECAR_MIN_SIZE 1024
+#endif
+
+#ifndef FTP_COPY_CHUNK_SIZE
+#define FTP_COPY_CHUNK_SIZE 4096
+#endif
+#ifndef FTP_JOBS_MAX
+#define FTP_JOBS_MAX 4
+#endif
+#ifndef FTP_JOB_SLICE_BUDGET
+#define FTP_JOB_SLICE_BUDGET 2000
+#endif
+#ifndef FTP_HASH_CHUNK_SIZE
+#define FTP_HASH_CHUNK_SIZE 4096
+#endif
+#ifndef FTP_DIGEST_CACHE_SIZE
+#define FTP_DIGEST_CACHE_SIZE 8
+#endif
+#ifndef FTP_DIGEST_SIDECAR
+#define FTP_DIGEST_SIDECAR 0
+#endif
+#ifndef FTP_DIGEST_SUFFIX
+#define FTP_DIGEST_SUFFIX ".ftpsum"
+#endif
+#ifndef FTP_DIGEST_SIDECAR_MAX
+#define FTP_DIGEST_SIDECAR_MAX 384
+#endif
+#ifndef FTP_UPLOAD_DIGEST
+#define FTP_UPLOAD_DIGEST 0
+#endif
+#ifndef FTP_SKIP_IDENTICAL
+#define FTP_SKIP_IDENTICAL 0
+#endif
+#ifndef FTP_STOR_BACKUP_SUFFIX
+#define FTP_STOR_BACKUP_SUFFIX ".bak"
+#endif
+#ifndef FTP_STOR_HOLD_SIZE
+#define FTP_STOR_HOLD_SIZE (FTP_WRITE_BUFFER_SIZE * 2)
+#endif
+#ifndef FTP_STOR_TEMP_SUFFIX
+#define FTP_STOR_TEMP_SUFFIX ".part"
+#endif
+// Truncates through the VFS path on ESP32, which relies on core internals.
+#ifndef FTP_VFS_TRUNCATE
+#define FTP_VFS_TRUNCATE 0
+#endif
+
+#ifndef FTP_RX_HIGH_WATERMARK
+#define FTP_RX_HIGH_WATERMARK (FTP_WRITE_BUFFER_SIZE / 2)
+#endif
+#ifndef FTP_RX_LOW_WATERMARK
+#define FTP_RX_LOW_WATERMARK (FTP_WRITE_BUFFER_SIZE / 4)
+#endif
 
 class AsyncFTPCommand;
+class AsyncFTPDeflate;
+class AsyncFTPInflate;
+class AsyncFTPJob;
+class AsyncFTPCopyJob;
+class AsyncFTPHashJob;
+class AsyncFTPRewriteJob;
 class AsyncFTPPasiveClient;
 class AsyncFTPPasiveServer;
 class AsyncFTPClient;
@@ -38,6 +177,18 @@ class AsyncFTPServer;
 
 typedef std::function<void(void *, AsyncFTPClient *)> AsyncFTPCommandHandler;
 
+// FTP verbs are 3 or 4 characters, so a verb packed upper-cased into a
+// uint32_t identifies a command and can be used as a switch label.
+constexpr uint32_t ftpVerbPack(uint32_t verb, char c)
+{
+  return (verb << 8) | (uint8_t)(c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c);
+}
+
+constexpr uint32_t ftpVerb(const char *verb, uint32_t packed = 0)
+{
+  return *verb ? ftpVerb(verb + 1, ftpVerbPack(packed, *verb)) : packed;
+}
+
 typedef enum
 {
   FTP_TYPE_ASCII,
@@ -46,6 +197,121 @@ typedef enum
   FTP_TYPE_LOCAL,
 } FTPDataType;
 
+typedef enum
+{
+  FTP_MODE_STREAM,
+  FTP_MODE_DEFLATE,
+} FTPTransmissionMode;
+
+typedef enum
+{
+  FTP_TRANSFER_STOP_AND_WAIT, // One read buffer in flight, refilled on every ACK
+  FTP_TRANSFER_PIPELINED,     // Up to FTP_SEND_BUFFER_COUNT read-ahead buffers in flight
+} FTPTransferMode;
+
+typedef enum
+{
+  FTP_FLUSH_SEGMENT, // Write every received TCP segment straight to the file
+  FTP_FLUSH_BLOCK,   // Coalesce into whole blocks, flush the tail on close
+} FTPFlushPolicy;
+
+typedef struct
+{
+  uint32_t uploads;
+  uint32_t fsWrites;
+  uint64_t bytes;
+  uint64_t bytesWritten;
+  uint32_t lastFsWrites;
+  size_t lastBytes;
+  size_t lastBytesWritten;
+} FTPUploadStats;
+
+typedef struct
+{
+  bool exists;
+  bool isDirectory;
+  size_t size;
+  time_t lastWrite;
+} FTPFileStat;
+
+typedef struct
+{
+  uint32_t hits;
+  uint32_t misses;
+} FTPStatCacheStats;
+
+typedef std::shared_ptr<const std::vector<uint8_t>> FTPListing;
+
+// File contents held by the hot-file tier, in PSRAM when the board has it.
+struct FTPHotFile
+{
+  uint8_t *data;
+  size_t size;
+
+  ~FTPHotFile() { free(data); }
+};
+
+typedef std::shared_ptr<const FTPHotFile> FTPHotFileRef;
+
+typedef struct
+{
+  uint32_t hits;
+  uint32_t misses;
+  uint64_t bytesServed;
+} FTPHotCacheStats;
+
+// Reports the capacity of a mounted filesystem; false if it is unknown.
+typedef std::function<bool(uint64_t &total, uint64_t &used)> AsyncFTPUsageHandler;
+
+// A filesystem attached at a virtual prefix such as "/LittleFS". Space is
+// queried when mounting and then kept up to date by the server.
+typedef struct
+{
+  String prefix;
+  FS *fs;
+  AsyncFTPUsageHandler usage;
+  bool sized;
+  uint64_t total;
+  uint64_t used;
+  bool stale;
+  uint32_t changed;
+} FTPMount;
+
+// Produces the content of a virtual file: fills buf with up to len bytes
+// starting at offset and returns how many were written; 0 ends the file.
+typedef std::function<size_t(void *arg, uint8_t *buf, size_t len, size_t offset)> AsyncFTPFileProducer;
+
+typedef enum
+{
+  FTP_SINK_BEGIN, // An upload starts
+  FTP_SINK_DATA,  // The next chunk of the upload
+  FTP_SINK_END,   // All data has arrived; false reports the upload as failed
+  FTP_SINK_ABORT, // The upload failed or the connection was lost
+} FTPSinkEvent;
+
+// Consumes an upload to a virtual file, e.g. an OTA writer. Returning false
+// from BEGIN, DATA or END fails the upload; ABORT follows unless END failed.
+typedef std::function<bool(void *arg, FTPSinkEvent event, const uint8_t *data, size_t len)> AsyncFTPUploadSink;
+
+// A virtual file is readable when it has a producer and writable when it
+// has a sink.
+typedef struct
+{
+  String path;
+  AsyncFTPFileProducer producer;
+  void *arg;
+  size_t sizeHint;
+  AsyncFTPUploadSink sink;
+  void *sinkArg;
+} FTPVirtualFile;
+
+typedef enum
+{
+  FTP_HASH_CRC32,
+  FTP_HASH_MD5,
+  FTP_HASH_SHA256,
+} FTPHashAlgorithm;
+
 typedef enum
 {
   FTP_COMMAND_NONE,
@@ -58,27 +324,340 @@ typedef enum
   FTP_COMMAND_APPE
 } FTPCommand;
 
+// Non-owning view into the current command line.
+class FTPToken
+{
+public:
+  const char *data = nullptr;
+  size_t length = 0;
+
+  FTPToken() = default;
+  FTPToken(const char *d, size_t l) : data(d), length(l) {};
+
+  bool isEmpty(void) const { return !length; }
+  bool equalsIgnoreCase(const char *s) const;
+  String toString(void) const;
+};
+
 class AsyncFTPCommand
 {
 private:
-  String _buffer;
-  int _index = 0;
+  // Holds at most one line; bytes after its CRLF stay with the caller until
+  // the line has been handled, so nothing is ever shifted or re-scanned.
+  char _buffer[FTP_COMMAND_LINE_MAX + 1];
+  size_t _length = 0;
+  size_t _index = 0;
+  FTPToken _verb;
+  bool _hasLine = false;
+  bool _overflow = false;
 
 public:
   AsyncFTPCommand() = default;
 
-  void write(const void *data, size_t len);
+  size_t write(const void *data, size_t len);
 
   bool eof(void) const;
   void skipWs(void);
+  uint32_t getVerb(void);
+  // The verb as sent, for verbs longer than getVerb() can pack.
+  const FTPToken &verbToken(void) const;
+  FTPToken word(void);
+  FTPToken rest(void);
   String getWord(void);
   String getRest(void);
+  // Back to the first argument, as right after getVerb().
+  void rewind(void);
 
   bool hasLine(void) const;
+  bool lineTooLong(void) const;
   String peekLine(void);
   void nextLine(void);
 };
 
+// Streaming zlib encoder for MODE Z. Input is staged in the encoder's own
+// window (inputBuffer/commitInput or write) and compressed by read().
+class AsyncFTPDeflate
+{
+private:
+  uint8_t *_window = nullptr;
+  uint16_t *_head = nullptr;
+  uint8_t _windowBits;
+  uint8_t _hashBits;
+  size_t _windowSize;
+  size_t _pos;
+  size_t _end;
+  uint32_t _adler;
+  uint32_t _bitBuf;
+  uint8_t _bitCount;
+  uint8_t _state;
+  uint8_t *_out;
+  size_t _outPos;
+  size_t _totalIn;
+  size_t _totalOut;
+
+  uint32_t _hash(size_t pos) const;
+  void _putBits(uint32_t value, uint8_t count);
+  void _putLiteral(uint8_t c);
+  void _putMatch(size_t len, size_t dist);
+
+public:
+  AsyncFTPDeflate() = default;
+  ~AsyncFTPDeflate();
+
+  bool begin(uint8_t windowBits = FTP_DEFLATE_WINDOW_BITS, uint8_t hashBits = FTP_DEFLATE_HASH_BITS);
+  void end(void);
+
+  uint8_t *inputBuffer(size_t &space);
+  void commitInput(size_t len);
+  size_t write(const uint8_t *data, size_t len);
+  size_t read(uint8_t *out, size_t len, bool finish);
+
+  bool finished(void) const;
+  size_t totalIn(void) const;
+  size_t totalOut(void) const;
+};
+
+// Streaming zlib decoder for MODE Z uploads. write() consumes compressed
+// input until the output window is full; output()/consume() drain it.
+class AsyncFTPInflate
+{
+private:
+  uint8_t *_window = nullptr;
+  uint8_t _windowBits;
+  size_t _windowSize;
+  size_t _wpos;
+  size_t _flushPos;
+  size_t _pending;
+  size_t _total;
+  uint64_t _bitBuf;
+  uint8_t _bitCount;
+  uint8_t _state;
+  bool _final;
+  uint32_t _adler;
+  size_t _storedLeft;
+  uint16_t _hlit;
+  uint16_t _hdist;
+  uint16_t _hclen;
+  uint16_t _lengthIndex;
+  uint8_t _lengths[320];
+  uint16_t _litCount[16];
+  uint16_t _litSymbol[288];
+  uint16_t _distCount[16];
+  uint16_t _distSymbol[30];
+
+  bool _build(uint16_t *count, uint16_t *symbol, const uint8_t *lengths, size_t n);
+  bool _bits(uint8_t n, uint32_t &value);
+  int _decode(const uint16_t *count, const uint16_t *symbol);
+  void _put(uint8_t c);
+  int _step(const uint8_t *&in, const uint8_t *end);
+
+public:
+  AsyncFTPInflate() = default;
+  ~AsyncFTPInflate();
+
+  bool begin(uint8_t windowBits = FTP_INFLATE_WINDOW_BITS);
+  void end(void);
+
+  size_t write(const uint8_t *data, size_t len);
+  const uint8_t *output(size_t &len);
+  void consume(size_t len);
+
+  bool finished(void) const;
+  bool failed(void) const;
+};
+
+// Precompressed "<file>.gz" next to a source file. The gzip header carries the
+// zlib framing of the stored deflate body, so a MODE Z download can be served
+// from it without running the compressor. Sidecars are written as a side
+// effect of the first compressed download.
+class AsyncFTPSidecar
+{
+private:
+  File _file;
+  FS *_fs = nullptr;
+  bool _writing = false;
+  uint8_t _frame[6];
+  size_t _framePos;
+  size_t _bodyLeft;
+  size_t _held;
+  uint32_t _crc;
+  size_t _size;
+  size_t _expectedSize;
+
+  static bool _readHeader(File &file, uint8_t *header);
+
+public:
+  ~AsyncFTPSidecar();
+
+  static String pathFor(const String &path);
+  static bool invalidate(FS &fs, const String &path);
+
+  bool open(FS &fs, File &source);
+  bool create(FS &fs, File &source);
+  void end(void);
+
+  size_t read(uint8_t *buf, size_t len);
+
+  void update(const uint8_t *data, size_t len);
+  void write(const uint8_t *data, size_t len);
+  void commit(void);
+
+  bool reading(void) const;
+};
+
+// Resumable work run by AsyncFTPServer::loop() in time-bounded slices, so a
+// long operation never blocks the TCP task. The final reply goes to the
+// session that started the job, if it is still connected.
+class AsyncFTPJob
+{
+protected:
+  AsyncFTPServer *_server;
+  AsyncFTPClient *_client;
+
+public:
+  AsyncFTPJob(AsyncFTPServer *s, AsyncFTPClient *c) : _server(s), _client(c) {};
+  virtual ~AsyncFTPJob() {};
+
+  // Does one small unit of work; false once the job has finished.
+  virtual bool step(void) = 0;
+  virtual void cancel(void) = 0;
+  // One line of progress for STAT.
+  virtual String status(void) const = 0;
+
+  void detach(void);
+  AsyncFTPClient *client(void) const;
+};
+
+// Server-side copy or cross-filesystem move, one chunk per step.
+class AsyncFTPCopyJob : public AsyncFTPJob
+{
+private:
+  bool _move;
+  bool _done = false;
+
+  String _from;
+  String _to;
+  FS *_srcFs;
+  FS *_dstFs;
+  String _srcPath;
+  String _dstPath;
+  File _src;
+  File _dst;
+  size_t _size = 0;
+  size_t _copied = 0;
+
+  uint8_t _buf[FTP_COPY_CHUNK_SIZE];
+
+  void _finish(const char *error);
+
+public:
+  AsyncFTPCopyJob(AsyncFTPServer *s, AsyncFTPClient *c, bool move) : AsyncFTPJob(s, c), _move(move) {};
+  ~AsyncFTPCopyJob();
+
+  bool begin(const String &from, const String &to);
+  bool step(void) override;
+  // Stops the job and removes the partial destination.
+  void cancel(void) override;
+  String status(void) const override;
+
+  bool move(void) const;
+  size_t size(void) const;
+  size_t copied(void) const;
+};
+
+// Digest of a hash or checksum command, fed incrementally. SHA-256 uses
+// mbedtls, and with it the SHA accelerator, on ESP32.
+class AsyncFTPDigest
+{
+private:
+  FTPHashAlgorithm _algorithm = FTP_HASH_SHA256;
+  uint32_t _crc;
+  MD5Builder _md5;
+#if defined(ESP32)
+  mbedtls_sha256_context _sha;
+#else
+  uint32_t _shaState[8];
+  uint8_t _shaBlock[64];
+  uint64_t _shaLength;
+
+  void _shaTransform(const uint8_t *block);
+#endif
+
+public:
+  AsyncFTPDigest();
+  ~AsyncFTPDigest();
+
+  void begin(FTPHashAlgorithm algorithm);
+  void update(const uint8_t *data, size_t len);
+  // Lower-case hex digest.
+  String finish(void);
+
+  static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len);
+  static const char *name(FTPHashAlgorithm algorithm);
+  static bool parse(const String &name, FTPHashAlgorithm &algorithm);
+
+  // Digests persisted next to a file, one line per algorithm after a marker
+  // line. A line only matches while the file keeps the size and modification
+  // time it had. A file without the marker is never overwritten or removed.
+  static String sidecarPath(const String &path);
+  static bool loadSidecar(FS &fs, const String &path, FTPHashAlgorithm algorithm, const FTPFileStat &st,
+                          String &digest);
+  static bool storeSidecar(FS &fs, const String &path, FTPHashAlgorithm algorithm, const String &digest,
+                           const FTPFileStat &st);
+  static bool removeSidecar(FS &fs, const String &path);
+};
+
+// Digest of a file or byte range, one chunk per step. Whole-file digests are
+// kept in the server's digest cache.
+class AsyncFTPHashJob : public AsyncFTPJob
+{
+private:
+  FTPHashAlgorithm _algorithm;
+  bool _extended;
+  bool _done = false;
+
+  String _path;
+  File _file;
+  size_t _start = 0;
+  size_t _size = 0;
+  size_t _hashed = 0;
+  bool _whole = false;
+  uint32_t _generation;
+  AsyncFTPDigest _digest;
+
+  uint8_t _buf[FTP_HASH_CHUNK_SIZE];
+
+public:
+  // Extended jobs answer XCRC/XMD5/XSHA256, the others HASH.
+  AsyncFTPHashJob(AsyncFTPServer *s, AsyncFTPClient *c, FTPHashAlgorithm algorithm, bool extended)
+      : AsyncFTPJob(s, c), _algorithm(algorithm), _extended(extended) {};
+
+  bool begin(const String &path, size_t offset, size_t length);
+  bool step(void) override;
+  void cancel(void) override;
+  String status(void) const override;
+
+  static String formatReply(bool extended, FTPHashAlgorithm algorithm, size_t start, size_t size,
+                            const String &digest, const String &path);
+};
+
+// Copies the unchanged prefix of a skip-identical upload into its new
+// version once the upload first differs. It belongs to the data channel, not
+// to a session, so it neither replies nor blocks commands.
+class AsyncFTPRewriteJob : public AsyncFTPJob
+{
+private:
+  AsyncFTPPasiveServer *_channel;
+
+public:
+  AsyncFTPRewriteJob(AsyncFTPServer *s, AsyncFTPPasiveServer *channel)
+      : AsyncFTPJob(s, nullptr), _channel(channel) {};
+
+  bool step(void) override;
+  void cancel(void) override;
+  String status(void) const override;
+};
+
 class AsyncFTPPasiveClient
 {
 private:
@@ -87,20 +666,35 @@ private:
 public:
   AsyncFTPPasiveClient(AsyncClient *c) : _client(c) {};
 
+  static size_t formatDirEntry(char *buf, size_t len, const char *name, bool isDir,
+                               size_t size, time_t t, const struct tm &now);
+  static size_t formatFacts(char *buf, size_t len, const char *name, bool isDir,
+                            size_t size, time_t t, const char *perm = nullptr);
+
   void writeDirEntry(File &file);
   void writeDirEntry(const String &name, bool isDir = true, size_t size = 0, time_t t = 0);
   void writeDirEntry(const char *name, bool isDir = true, size_t size = 0, time_t t = 0);
   size_t write(const char *data, size_t size);
+  size_t add(const char *data, size_t size, uint8_t flags = ASYNC_WRITE_FLAG_COPY);
+  bool send(void);
+  size_t space(void);
 
+  void ackLater(void);
+  size_t ack(size_t len);
+
+  AsyncClient *client(void) const;
   void close();
+  // abort drops the connection instead of closing it gracefully.
+  void detach(bool abort);
 };
 
 class AsyncFTPPasiveServer
 {
 private:
   AsyncFTPServer *_ftpServer;
-  AsyncFTPClient *_controlClient;
+  AsyncFTPClient *_controlClient = nullptr;
 
+  uint16_t _port;
   AsyncServer _server;
   AsyncFTPPasiveClient *_client = nullptr;
 
@@ -108,25 +702,162 @@ private:
   File _file;
   FS *_fs = nullptr;
 
-  size_t _remainingSpace;
-  uint8_t _sendBuf[2048];
-  size_t _sendBufSize;
-  size_t _sendBufOffset;
-  bool _storeSuccess;
+  const char *_transferError = nullptr;
+  AsyncFTPDeflate *_deflate = nullptr;
+  AsyncFTPInflate *_inflate = nullptr;
+  AsyncFTPSidecar _sidecar;
+  bool _sidecarCreated = false;
+
+  // Running digest of the uploaded bytes, checked against an expected value
+  // and cached for HASH when the upload replaced the whole file.
+  AsyncFTPDigest *_storeDigest = nullptr;
+  bool _digestEnabled = false;
+  FTPHashAlgorithm _digestAlgorithm;
+  String _expectedDigest;
+  bool _digestWhole;
+
+  uint64_t _remainingSpace;
+  size_t _storeStartSize;
+  size_t _storeBytes;
+  size_t _storeWritten;
+  uint32_t _storeWrites;
+
+  // Skip-identical upload: _file is the existing file, compared with the
+  // received bytes. Only once they differ is the new version written to a
+  // temporary file, which replaces the original when the upload completes.
+  // The matching prefix is copied over by a job; data that arrives before it
+  // is done waits in _held, and a disconnect in the meantime leaves the rest
+  // of the transfer to the job.
+  bool _comparing = false;
+  size_t _compared;
+  File _original;
+  size_t _prefixLeft = 0;
+  std::vector<uint8_t> _held;
+  AsyncFTPRewriteJob *_rewriteJob = nullptr;
+  bool _finishPending = false;
+
+  // STOR receive window: bytes held back from TCP while the write path is
+  // above the session's high watermark. _rxStalled marks a poll interval
+  // that passed without a segment while the window was held.
+  size_t _rxHeld = 0;
+  bool _rxThrottled = false;
+  bool _rxStalled = false;
+
+  // close() runs the disconnect handler at once, so a connection failed from
+  // inside its own data callback is closed from the next poll instead.
+  bool _closing = false;
+
+  // Downloads and uploads never run on the same data connection at once,
+  // so the STOR write-behind block overlays the send ring.
+  union
+  {
+    uint8_t _sendBuf[FTP_SEND_BUFFER_COUNT][FTP_SEND_BUFFER_SIZE];
+    uint8_t _writeBuf[FTP_WRITE_BUFFER_SIZE];
+  };
+
+  size_t _writeBufSize = 0;
+  size_t _writeBufLimit = 0;
+
+  // RETR/LIST read-ahead ring. Buffers are queued without copy, so a slot
+  // stays owned by lwIP until every byte in it has been acknowledged.
+  size_t _sendBufSize[FTP_SEND_BUFFER_COUNT];
+  uint8_t _sendDepth = 1;
+  uint8_t _sendHead = 0;
+  uint8_t _sendFilled = 0;
+  uint8_t _sendQueued = 0;
+  size_t _sendBufOffset = 0;
+  size_t _sendBufAcked = 0;
+  bool _sendEof = false;
+  size_t _sendRemaining = SIZE_MAX;
+
+  uint8_t _listIndex = 0;
+  bool _listVirtual;
+  size_t _listVirtualIndex;
+  struct tm _listNow;
+  String _listKey;
+  FTPListing _listReplay;
+  size_t _listReplayPos;
+  std::vector<uint8_t> _listCapture;
+  bool _listCapturing = false;
+  uint32_t _listGeneration;
+
+  FTPHotFileRef _hotFile;
+  size_t _hotPos;
+  std::shared_ptr<FTPHotFile> _hotCapture;
+  size_t _hotCapturePos;
+  String _hotKey;
+  uint32_t _hotGeneration;
 
-  void _sendFile(void);
-  void _sendList(void);
+  AsyncFTPFileProducer _producer;
+  void *_producerArg;
+  size_t _producerPos;
+
+  AsyncFTPUploadSink _sink;
+  void *_sinkArg;
+
+  void _resetSendRing(void);
+  bool _sendDone(void) const;
+  size_t _readSource(uint8_t *buf, size_t len);
+  size_t _readCompressed(uint8_t *buf, size_t len);
+  void _fillSendRing(void);
+  void _ackSendRing(size_t len);
+  void _sendData(void);
+  void _resetList(void);
+  void _endList(void);
+  void _endHot(void);
+  size_t _readList(uint8_t *buf, size_t len);
+  int _renderListEntry(char *buf, size_t len);
+  int _renderVirtualEntry(char *buf, size_t len);
+  void _endCodec(void);
+
+  void _resetWriteBuf(void);
+  bool _flushWriteBuf(void);
+  bool _writeOut(const uint8_t *data, size_t len);
+  bool _storeData(const uint8_t *data, size_t len);
+  bool _bufferData(const uint8_t *data, size_t len);
+  bool _storeCompressed(const uint8_t *data, size_t len);
+  void _abortStore(void);
+  void _endDigest(void);
+  bool _beginRewrite(bool wait);
+  void _endPrefix(void);
+  void _failPrefix(void);
+  void _endRewriteJob(void);
+  bool _finishCompare(void);
+  void _finishTransfer(void);
+  void _releaseReceive(void);
   void _tryStartTransfer(void);
 
   void _onClientAck(size_t len, uint32_t time);
   void _onClientData(void *data, size_t len);
-  void _onClientDisconnect();
+  void _onClientPoll(void);
+  void _onClientDisconnect(AsyncClient *c);
   void _onClient(AsyncClient *c);
 
 public:
-  AsyncFTPPasiveServer(AsyncFTPServer *s, AsyncFTPClient *c, uint16_t port);
+  AsyncFTPPasiveServer(AsyncFTPServer *s, uint16_t port);
+  ~AsyncFTPPasiveServer();
+
+  uint16_t port(void) const;
+  bool listening(void);
 
-  void setCommand(FTPCommand c, File f, FS *fs = nullptr);
+  void attach(AsyncFTPClient *c);
+  void detach(void);
+
+  bool busy(void) const;
+  // Serves the next RETR from the hot-file tier instead of the file.
+  void setHotFile(FTPHotFileRef file, size_t offset);
+  // Serves the next RETR from a virtual file's producer.
+  void setProducer(const FTPVirtualFile &file, size_t offset);
+  // Feeds the next STOR to a virtual file's sink.
+  void setSink(const FTPVirtualFile &file);
+  // Compares the next STOR with the file it is given and rewrites the file
+  // only if the content differs.
+  void setSkipIdentical(void);
+  // One chunk of a pending rewrite's prefix; false once there is none left.
+  bool copyPrefix(void);
+  // Hashes the next STOR; a non-empty expected digest must match.
+  void setStoreDigest(FTPHashAlgorithm algorithm, const String &expected, bool whole);
+  void setCommand(FTPCommand c, File f, FS *fs = nullptr, size_t length = SIZE_MAX);
   void end(void);
 };
 
@@ -138,14 +869,37 @@ private:
 
   AsyncFTPCommand _command;
   bool _authenticated = false;
+  bool _closing = false;
   String _cwd = "/";
   FTPDataType _dataType = FTP_TYPE_ASCII;
+  FTPTransmissionMode _mode = FTP_MODE_STREAM;
+  FTPHashAlgorithm _hashAlgorithm = FTP_HASH_SHA256;
+  FTPHashAlgorithm _expectedAlgorithm;
+  String _expectedDigest = "";
+  uint64_t _uploadReceived = 0;
+  uint64_t _uploadWritten = 0;
   bool _utf8 = true;
+  size_t _restOffset = 0;
+  size_t _restLength = SIZE_MAX;
+  size_t _rxLowWatermark;
+  size_t _rxHighWatermark;
+  bool _skipIdentical;
 
+  // Channel armed by the last PASV, and channels with a transfer running.
   AsyncFTPPasiveServer *_pasiveServer = nullptr;
+  AsyncFTPPasiveServer *_dataChannels[FTP_DATA_CHANNELS_MAX];
+  size_t _dataChannelCount = 0;
   String _renameFromPath = "";
+  String _copyFromPath = "";
+
+  // Replies produced while handling one received batch are sent together.
+  char _replyBuf[FTP_REPLY_BUFFER_SIZE];
+  size_t _replyLen = 0;
+  bool _replyBatch = false;
 
   void _onData(void *buf, size_t len);
+  void _onPoll(void);
+  void _queueReply(const char *data, size_t len);
 
   void _sendSyntaxError(void);
   void _sendBadSequence(void);
@@ -157,14 +911,20 @@ private:
 
   void _handlePASV(void);
   void _handleTYPE(void);
+  void _handleMODE(void);
   void _handleOPTS(void);
 
-  void _handleSTOR(void);
+  void _handleSTOR(FTPCommand command = FTP_COMMAND_STOR);
   void _handleSIZE(void);
   void _handleRETR(void);
-  void _handleLIST(void);
+  void _handleREST(void);
+  void _handleRANG(void);
+  void _handleLIST(FTPCommand command = FTP_COMMAND_LIST);
+  void _handleMLST(void);
   void _handleRNFR(void);
   void _handleRNTO(void);
+  void _handleSITE(void);
+  void _startCopy(const String &from, const String &to, bool move);
   void _handleDELE(void);
   void _handleRMD(void);
   void _handleMKD(void);
@@ -172,49 +932,315 @@ private:
 
   void _handleSYST(void);
   void _handleSTAT(void);
+  void _handleABOR(void);
+  void _handleHASH(FTPHashAlgorithm algorithm, bool extended);
   void _handleFEAT(void);
 
   void _handleCommand(void);
 
+  void _startTransfer(FTPCommand command, File file, FS *fs = nullptr, size_t length = SIZE_MAX);
+  void _reapDataChannels(void);
+
 public:
   AsyncFTPClient(AsyncFTPServer *s, AsyncClient *c);
   ~AsyncFTPClient();
 
   void write(String data);
   void write(const char *data);
+  void writef(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  void flush(void);
+
+  // Fixed reply, already terminated with CRLF.
+  template <size_t N>
+  void reply(const char (&data)[N])
+  {
+    _queueReply(data, N - 1);
+    if (!_replyBatch)
+      flush();
+  }
 
+  void setReceiveWatermarks(size_t low, size_t high);
+  size_t receiveLowWatermark(void) const;
+  size_t receiveHighWatermark(void) const;
+
+  FTPTransmissionMode transmissionMode(void) const;
+
+  void recordUpload(size_t received, size_t written);
+
+  AsyncFTPCommand &command(void);
   IPAddress localIP(void);
 };
 
 class AsyncFTPServer
 {
 private:
+  struct CommandEntry
+  {
+    uint32_t verb;
+    AsyncFTPCommandHandler handler;
+    void *arg;
+  };
+
   AsyncServer _server;
+  std::vector<CommandEntry> _commands;
+
+  // Passive data ports in use, one bit per port of the configured range,
+  // and listeners kept bound between transfers.
+  uint16_t _pasvPortMin = FTP_PASV_PORT_MIN;
+  uint16_t _pasvPortMax = FTP_PASV_PORT_MAX;
+  uint16_t _pasvPortNext = 0;
+  std::vector<uint32_t> _pasvPorts;
+  std::vector<AsyncFTPPasiveServer *> _pasvPool;
+
+  void _initPassivePool(void);
+  uint16_t _allocatePassivePort(void);
+  void _freePassivePort(uint16_t port);
   const char *_user = nullptr;
   const char *_password = nullptr;
+  FTPTransferMode _transferMode = FTP_TRANSFER_PIPELINED;
+  FTPFlushPolicy _flushPolicy = FTP_FLUSH_BLOCK;
+  size_t _flushBlockSize = FTP_WRITE_BUFFER_SIZE;
+  FTPUploadStats _uploadStats = {};
+  size_t _rxLowWatermark = FTP_RX_LOW_WATERMARK;
+  size_t _rxHighWatermark = FTP_RX_HIGH_WATERMARK;
+  bool _uploadDigest = FTP_UPLOAD_DIGEST;
+  bool _digestSidecar = FTP_DIGEST_SIDECAR;
+  bool _skipIdentical = FTP_SKIP_IDENTICAL;
 
-#if FTP_USE_LITTLEFS
-  bool _littleFSAvailable = false;
-#endif
-#if FTP_USE_SDFS
-  bool _sdFSAvailable = false;
+  // Metadata of recently looked up paths, shared by all sessions, keyed on
+  // the normalized virtual path and evicted least recently used first.
+  struct StatEntry
+  {
+    String path;
+    FTPFileStat stat;
+    uint32_t lastUse;
+    uint32_t cachedAt;
+  };
+
+  StatEntry _statCache[FTP_STAT_CACHE_SIZE];
+  uint32_t _statCacheTtl = FTP_STAT_CACHE_TTL;
+  uint32_t _cacheClock = 0;
+  FTPStatCacheStats _statCacheStats = {};
+
+  // Rendered LIST/MLSD output per directory, bounded by _listCacheBudget.
+  struct ListEntry
+  {
+    String path;
+    FTPCommand command;
+    FTPListing listing;
+    uint32_t lastUse;
+  };
+
+  std::vector<ListEntry> _listCache;
+  size_t _listCacheBudget = FTP_LIST_CACHE_BUDGET;
+  size_t _listCacheSize = 0;
+
+  // Mounts sorted by prefix, so a lookup is a binary search per path
+  // component rather than a scan over all mounts.
+  std::vector<FTPMount> _mounts;
+
+  const FTPMount *_findMount(const char *path, size_t len) const;
+  FTPMount *_mountOf(FS *fs);
+  static void _queryUsage(FTPMount &mount);
+
+  void _evictListings(size_t limit);
+  void _dropListing(size_t index);
+
+  // Whole files served from RAM. Admission and eviction compare access
+  // frequencies from a small count-min sketch, so a burst of one-off
+  // downloads cannot flush files that are fetched over and over.
+  struct HotEntry
+  {
+    String path;
+    FTPHotFileRef file;
+  };
+
+  std::vector<HotEntry> _hotCache;
+  size_t _hotCacheBudget = FTP_HOT_CACHE_BUDGET;
+  size_t _hotCacheSize = 0;
+  FTPHotCacheStats _hotCacheStats = {};
+  uint8_t _hotFreq[FTP_HOT_SKETCH_SIZE] = {};
+  uint32_t _hotFreqSamples = 0;
+
+  // Bumped by every invalidation, so a capture that raced with a write is
+  // never stored.
+  uint32_t _cacheGeneration = 0;
+
+  uint8_t _hotFrequency(const String &key, bool touch);
+  bool _evictHotFiles(size_t size, uint8_t freq, bool apply);
+
+  // Sorted by path for lookup on every RETR and stat.
+  std::vector<FTPVirtualFile> _virtualFiles;
+
+  struct DigestEntry
+  {
+    String path;
+    FTPHashAlgorithm algorithm;
+    String digest;
+    uint32_t lastUse;
+  };
+
+  DigestEntry _digestCache[FTP_DIGEST_CACHE_SIZE];
+
+  void _cacheDigest(const String &key, FTPHashAlgorithm algorithm, const String &digest);
+
+  AsyncFTPJob *_jobs[FTP_JOBS_MAX] = {};
+  size_t _jobNext = 0;
+  uint32_t _jobSliceBudget = FTP_JOB_SLICE_BUDGET;
+  bool _loopCalled = false;
+
+#if defined(ESP32)
+  std::recursive_mutex _mutex;
 #endif
 
 public:
   AsyncFTPServer(uint16_t port) : _server(port) {};
+  ~AsyncFTPServer();
 
   void begin(const char *user, const char *password);
 
+  // Runs deferred housekeeping and background jobs; call it from the
+  // sketch's loop(). Sketches that never call it still work, but jobs then
+  // run to completion inside the command that started them.
+  void loop(void);
+
+  // Must be called before begin().
+  void setPassivePortRange(uint16_t min, uint16_t max);
+  AsyncFTPPasiveServer *acquirePassive(AsyncFTPClient *client);
+  void releasePassive(AsyncFTPPasiveServer *pasv);
+
   const char *user(void) const;
   const char *password(void) const;
 
-#if FTP_USE_LITTLEFS
-  bool littleFSAvailable(void) const;
-#endif
-#if FTP_USE_SDFS
-  bool sdFSAvailable(void) const;
-#endif
+  // Handlers for built-in verbs are not called, except for SITE subcommands
+  // the server does not know and for XCRC and XMD5, where they take over.
+  bool on(const char *verb, AsyncFTPCommandHandler handler, void *arg = nullptr);
+  bool dispatchCommand(uint32_t verb, AsyncFTPClient *client);
+
+  void setTransferMode(FTPTransferMode mode);
+  FTPTransferMode transferMode(void) const;
+
+  void setFlushPolicy(FTPFlushPolicy policy, size_t blockSize = FTP_WRITE_BUFFER_SIZE);
+  FTPFlushPolicy flushPolicy(void) const;
+  size_t flushBlockSize(void) const;
+
+  void setReceiveWatermarks(size_t low, size_t high);
+  size_t receiveLowWatermark(void) const;
+  size_t receiveHighWatermark(void) const;
+
+  // Filesystems mounted without a usage handler report unlimited space.
+  uint64_t totalSpace(FS *fs);
+  uint64_t usedSpace(FS *fs);
+  uint64_t freeSpace(FS *fs);
+  // A delta of 0 records a change of unknown size and only schedules a resync.
+  void adjustUsedSpace(FS *fs, int64_t delta);
+
+  const FTPUploadStats &uploadStats(void) const;
+  // Hashes every upload with the session's HASH algorithm as it arrives, so
+  // HASH on a freshly uploaded file is answered from the digest cache.
+  void setUploadDigest(bool enabled);
+  bool uploadDigest(void) const;
+  // Default for new sessions; SITE SKIPIDENTICAL changes it per session.
+  void setSkipIdentical(bool enabled);
+  bool skipIdentical(void) const;
+  void recordUpload(size_t bytes, uint32_t fsWrites, size_t written);
+
+  // Attaches an already started filesystem at "/name". Prefixes may nest;
+  // a path resolves to the mount with the longest matching prefix.
+  bool mount(const char *prefix, FS &fs, AsyncFTPUsageHandler usage = nullptr);
+  bool unmount(const char *prefix);
+  size_t mountCount(void) const;
+  const FTPMount *mountAt(size_t index) const;
+
+  static String normalizePath(const String &path);
+  // Normalized path without a trailing slash, as used for cache lookups.
+  static String pathKey(const String &virtualPath);
+
+  String virtualPath(FS *fs, const String &fsPath) const;
+
+  // Mutating commands must invalidate the paths they touch. This drops the
+  // cached metadata and digests of the path and everything below it, and the
+  // cached listings of the path and its parent directory. Sketches that write
+  // to a mounted filesystem themselves should call it as well; otherwise
+  // metadata is only refreshed once it is older than the stat cache TTL, and
+  // listings, digests and hot files not at all. A TTL of 0 disables it.
+  bool stat(const String &virtualPath, FTPFileStat &st);
+  void invalidatePath(const String &virtualPath);
+  void invalidatePath(FS *fs, const String &fsPath);
+  void setStatCacheTtl(uint32_t ms);
+  uint32_t statCacheTtl(void) const;
+  const FTPStatCacheStats &statCacheStats(void) const;
+
+  // A budget of 0 disables the listing cache.
+  void setListCacheBudget(size_t bytes);
+  size_t listCacheBudget(void) const;
+  FTPListing findListing(const String &virtualPath, FTPCommand command);
+  void storeListing(const String &virtualPath, FTPCommand command, std::vector<uint8_t> &&data,
+                    uint32_t generation);
+
+  // A budget of 0 disables the hot-file tier. findHotFile() counts an access
+  // and returns the cached contents on a hit; admitHotFile() returns a buffer
+  // to capture a download into when the file is hot enough to be kept.
+  void setHotCacheBudget(size_t bytes);
+  size_t hotCacheBudget(void) const;
+  FTPHotFileRef findHotFile(const String &virtualPath);
+  std::shared_ptr<FTPHotFile> admitHotFile(const String &virtualPath, size_t size);
+  void storeHotFile(const String &virtualPath, std::shared_ptr<FTPHotFile> file, uint32_t generation);
+  void recordHotBytes(size_t bytes);
+  const FTPHotCacheStats &hotCacheStats(void) const;
+
+  uint32_t cacheGeneration(void) const;
+
+  // Whole-file digests, dropped by invalidatePath() like cached metadata.
+  // With the sidecar enabled, digests computed while a file was uploaded
+  // (persist) are also written next to it, so they survive eviction and
+  // reboots. Digests from HASH and its kin only ever go to RAM.
+  bool findDigest(const String &virtualPath, FTPHashAlgorithm algorithm, String &digest);
+  void storeDigest(const String &virtualPath, FTPHashAlgorithm algorithm, const String &digest,
+                   uint32_t generation, bool persist);
+  void setDigestSidecar(bool enabled);
+  bool digestSidecar(void) const;
+
+  // Read-only files whose content is produced on demand. They are listed in
+  // their parent directory with sizeHint as their size, 0 if it is unknown.
+  bool addVirtualFile(const char *path, AsyncFTPFileProducer producer, void *arg = nullptr,
+                      size_t sizeHint = 0);
+  // Uploads to path go to sink instead of a filesystem.
+  bool addUploadSink(const char *path, AsyncFTPUploadSink sink, void *arg = nullptr);
+  // Removes the path's producer and sink.
+  bool removeVirtualFile(const char *path);
+  const FTPVirtualFile *findVirtualFile(const String &virtualPath) const;
+  size_t virtualFileCount(void) const;
+  const FTPVirtualFile *virtualFileAt(size_t index) const;
+
+  // Takes ownership of the job; false if all job slots are in use. Before
+  // the first loop() call the job is run to completion instead.
+  bool startJob(AsyncFTPJob *job);
+  AsyncFTPJob *findJob(AsyncFTPClient *client) const;
+  // Jobs of a closed session run to completion without a reply.
+  void detachJobs(AsyncFTPClient *client);
+  // Time loop() may spend on jobs per call, in microseconds. Every call runs
+  // at least one step, so 0 means one step per call.
+  void setJobSliceBudget(uint32_t us);
+  uint32_t jobSliceBudget(void) const;
 
   bool resolveFsPath(const String &virtualPath, FS *&fs, String &fsPath, bool checkExists = false) const;
   File resolveFile(const String &virtualPath, const char *mode = FILE_READ, bool create = false);
+
+  // Sessions run in the AsyncTCP task and jobs in the sketch's loop(); every
+  // callback and loop() hold this lock, so replies and caches are never
+  // touched from both at once. Recursive, so public calls may nest.
+  void lock(void);
+  void unlock(void);
+};
+
+// Holds the server lock for the enclosing scope.
+class AsyncFTPLock
+{
+private:
+  AsyncFTPServer *_server;
+
+public:
+  explicit AsyncFTPLock(AsyncFTPServer *s) : _server(s) { _server->lock(); };
+  ~AsyncFTPLock() { _server->unlock(); };
 };